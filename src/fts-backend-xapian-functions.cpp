@@ -242,115 +242,990 @@ static int fts_backend_xapian_sqlite3_vector_icu(void *data, int argc, char **ar
 	return 0;
 }
 
-static bool fts_backend_xapian_sqlite3_dict_open(struct xapian_fts_backend *backend)
+class XDict
 {
-	if(backend->ddb!=NULL) return TRUE;
+	private:
+		std::unordered_set<std::string> words[HDRS_NB];
+		long nb;
+
+	public:
+
+	XDict() { nb=0; }
 
-	backend->dict_nb=0;
+	long size() { return nb; }
 
-	if(sqlite3_open_v2(backend->dict_db,&(backend->ddb),SQLITE_OPEN_FULLMUTEX | SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE,NULL) != SQLITE_OK )
+	void add(long h, const std::string & s)
 	{
-		i_error("FTS Xapian: Can not open %s : %s",backend->dict_db,sqlite3_errmsg(backend->ddb));
-		backend->ddb = NULL;
-		return FALSE;
+		if(words[h].insert(s).second) nb++;
+	}
+
+	void add(long h, icu::UnicodeString *t)
+	{
+		std::string s;
+		t->toUTF8String(s);
+		add(h,s);
+	}
+
+	void merge(XDict * d)
+	{
+		for(long h=0;h<HDRS_NB;h++)
+		{
+			for(auto & s : d->words[h])
+			{
+				if(words[h].insert(s).second) nb++;
+			}
+			d->words[h].clear();
+		}
+		d->nb=0;
+	}
+
+	void copy(XDict * d)
+	{
+		for(long h=0;h<HDRS_NB;h++)
+		{
+			for(auto & s : d->words[h])
+			{
+				if(words[h].insert(s).second) nb++;
+			}
+		}
+	}
+
+	void clear()
+	{
+		for(long h=0;h<HDRS_NB;h++) words[h].clear();
+		nb=0;
+	}
+
+	// Words containing k, for the expansion of the keywords not flushed in the dictionnary yet
+	void search(const std::string & k, long hdr, long maxk, std::set<std::string> & found)
+	{
+		for(long h=0;(h<HDRS_NB) && ((long)found.size()<maxk);h++)
+		{
+			if((hdr>=0) && (h!=hdr)) continue;
+			for(auto & s : words[h])
+			{
+				if((long)found.size()>=maxk) break;
+				if(s.find(k) != std::string::npos) found.insert(s);
+			}
+		}
+	}
+
+	void list(std::vector<std::pair<long,std::string>> & v)
+	{
+		for(long h=0;h<HDRS_NB;h++)
+		{
+			for(auto & s : words[h]) v.push_back(std::make_pair(h,s));
+		}
+	}
+
+	bool flush(sqlite3 * db, char * err_s)
+	{
+		sqlite3_stmt * stmt = NULL;
+		char * zErrMsg = 0;
+		bool ok = true;
+
+		if(sqlite3_prepare_v2(db,insertDictWord,-1,&stmt,NULL) != SQLITE_OK)
+		{
+			syslog(LOG_ERR,"FTS Xapian: Can not prepare (%s) : %s",insertDictWord,sqlite3_errmsg(db));
+			if(err_s!=NULL) sprintf(err_s,"FTS Xapian: Can not prepare (%s) : %s",insertDictWord,sqlite3_errmsg(db));
+			return false;
+		}
+
+		if(sqlite3_exec(db,"BEGIN TRANSACTION;",NULL,0,&zErrMsg) != SQLITE_OK)
+		{
+			syslog(LOG_ERR,"FTS Xapian: Can not begin dictionnary transaction : %s",zErrMsg);
+			if(err_s!=NULL) sprintf(err_s,"FTS Xapian: Can not begin dictionnary transaction : %s",zErrMsg);
+			if(zErrMsg!=NULL) sqlite3_free(zErrMsg);
+			sqlite3_finalize(stmt);
+			return false;
+		}
+
+		for(long h=0;(h<HDRS_NB) && ok;h++)
+		{
+			for(auto & s : words[h])
+			{
+				sqlite3_bind_text(stmt,1,s.c_str(),s.length(),SQLITE_STATIC);
+				sqlite3_bind_int(stmt,2,h);
+				sqlite3_bind_int(stmt,3,s.length());
+				if(sqlite3_step(stmt) != SQLITE_DONE)
+				{
+					syslog(LOG_ERR,"FTS Xapian: Can not add keyword (%s) : %s",s.c_str(),sqlite3_errmsg(db));
+					if(err_s!=NULL) sprintf(err_s,"FTS Xapian: Can not add keyword : %s",sqlite3_errmsg(db));
+					ok=false;
+					break;
+				}
+				sqlite3_reset(stmt);
+			}
+		}
+		sqlite3_finalize(stmt);
+
+		zErrMsg = 0;
+		if(sqlite3_exec(db,ok ? "COMMIT;" : "ROLLBACK;",NULL,0,&zErrMsg) != SQLITE_OK)
+		{
+			syslog(LOG_ERR,"FTS Xapian: Can not end dictionnary transaction : %s",zErrMsg);
+			if(err_s!=NULL) sprintf(err_s,"FTS Xapian: Can not end dictionnary transaction : %s",zErrMsg);
+			if(zErrMsg!=NULL) sqlite3_free(zErrMsg);
+			ok=false;
+		}
+
+		if(ok) clear();
+		return ok;
+	}
+};
+
+static bool fts_backend_xapian_dict_deferred()
+{
+	return (fts_xapian_settings.dictmode!=NULL) && (strcmp(fts_xapian_settings.dictmode,XAPIAN_DICT_COMMIT)==0);
+}
+
+static bool fts_backend_xapian_tokenize_stream()
+{
+	return (fts_xapian_settings.tokenize!=NULL) && (strcmp(fts_xapian_settings.tokenize,XAPIAN_TOKENIZE_STREAM)==0);
+}
+
+static std::atomic<long> fts_xapian_junk_dropped(0), fts_xapian_junk_truncated(0), fts_xapian_junk_chars(0);
+
+// Per field budgets : max bytes, max keywords (0 = no limit) and fields not indexed at all
+static long fts_xapian_field_bytes[HDRS_NB];
+static long fts_xapian_field_terms[HDRS_NB];
+static bool fts_xapian_field_skip[HDRS_NB];
+
+// List of "field:value" (or "field" alone for the skipped ones), separated by commas
+static void fts_backend_xapian_budgets_parse(const char * name, const char * s, long * values, bool * skip)
+{
+	if(s == NULL) return;
+
+	std::string list(s);
+	size_t b = 0;
+	while(b < list.length())
+	{
+		size_t e = list.find(',',b);
+		if(e == std::string::npos) e = list.length();
+		std::string item = list.substr(b,e-b);
+		b = e+1;
+		if(item.length()<1) continue;
+
+		size_t c = item.find(':');
+		long h = fts_backend_xapian_clean_header(item.substr(0,c).c_str());
+		long v = (c == std::string::npos) ? 0 : atol(item.c_str()+c+1);
+		if((h<0) || ((skip == NULL) && (v<1)) || ((skip != NULL) && (c != std::string::npos)))
+		{
+			i_error("FTS Xapian: '%s' parameter is incorrect (%s). Try '%s=%s'",name,item.c_str(),name,(skip == NULL) ? "bcc:256" : "bcc");
+			continue;
+		}
+		if(skip != NULL) skip[h] = true;
+		else values[h] = v;
+	}
+}
+
+static void fts_backend_xapian_budgets_init()
+{
+	for(long h=0;h<HDRS_NB;h++)
+	{
+		fts_xapian_field_bytes[h] = 0;
+		fts_xapian_field_terms[h] = 0;
+		fts_xapian_field_skip[h] = false;
+	}
+	fts_backend_xapian_budgets_parse("fieldbytes",fts_xapian_settings.fieldbytes,fts_xapian_field_bytes,NULL);
+	fts_backend_xapian_budgets_parse("fieldterms",fts_xapian_settings.fieldterms,fts_xapian_field_terms,NULL);
+	fts_backend_xapian_budgets_parse("skipfields",fts_xapian_settings.skipfields,NULL,fts_xapian_field_skip);
+}
+
+// Header of a term from its prefix (the words themselves are lowercase)
+static long fts_backend_xapian_term_header(icu::UnicodeString * t)
+{
+	long l = 0;
+	while((l < t->length()) && (t->charAt(l) >= 'A') && (t->charAt(l) <= 'Z')) l++;
+	for(long h=0;h<HDRS_NB;h++)
+	{
+		if((t->compare(0,l,icu::UnicodeString(hdrs_xapian[h])) == 0) && ((long)strlen(hdrs_xapian[h]) == l)) return h;
+	}
+	return -1;
+}
+
+static bool fts_backend_xapian_quotes_skip()
+{
+	return (fts_xapian_settings.quotes!=NULL) && (strcmp(fts_xapian_settings.quotes,XAPIAN_QUOTES_SKIP)==0);
+}
+
+static bool fts_backend_xapian_junk_filter()
+{
+	return (fts_xapian_settings.junkmode!=NULL) && (strcmp(fts_xapian_settings.junkmode,XAPIAN_JUNK_OFF)!=0);
+}
+
+// Long ASCII keywords made of hex digits, of random chars (base64, armour) or of mixed letters and digits (ids, tracking)
+static bool fts_backend_xapian_junk(icu::UnicodeString *t)
+{
+	long n = t->length();
+	if(n < (long)fts_xapian_settings.junklength) return false;
+
+	long counts[128] = { 0 };
+	long digits=0, letters=0, hex=0;
+	for(long i=0;i<n;i++)
+	{
+		UChar c = t->charAt(i);
+		if(c > 127) return false; // Scripts without spaces come as long keywords
+		counts[c]++;
+		if((c>='0') && (c<='9')) { digits++; hex++; }
+		else if((c>='a') && (c<='z'))
+		{
+			letters++;
+			if(c<='f') hex++;
+		}
+	}
+	if(hex == n) return true;
+	if((digits >= n*XAPIAN_JUNK_MIX) && (letters >= n*XAPIAN_JUNK_MIX)) return true;
+
+	float e = 0;
+	for(long i=0;i<128;i++)
+	{
+		if(counts[i]<1) continue;
+		float p = counts[i] / (float)n;
+		e -= p * std::log2(p);
+	}
+	return (e > XAPIAN_JUNK_ENTROPY);
+}
+
+static sqlite3 * fts_backend_xapian_sqlite3_dict_create(const char * path)
+{
+	sqlite3 * db = NULL;
+
+	if(sqlite3_open_v2(path,&db,SQLITE_OPEN_FULLMUTEX | SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE,NULL) != SQLITE_OK )
+	{
+		i_error("FTS Xapian: Can not open %s : %s",path,sqlite3_errmsg(db));
+		sqlite3_close(db);
+		return NULL;
 	}
 		  
 	char *zErrMsg = 0;
-	if(sqlite3_exec(backend->ddb,createDictTable,NULL,0,&zErrMsg) != SQLITE_OK )
+	if(sqlite3_exec(db,walDict,NULL,0,&zErrMsg) != SQLITE_OK )
+	{
+		i_warning("FTS Xapian: Can not execute (%s) : %s",walDict,zErrMsg);
+		if(zErrMsg!=NULL) sqlite3_free(zErrMsg);
+	}
+
+	zErrMsg =0;
+	if(sqlite3_exec(db,createDictTable,NULL,0,&zErrMsg) != SQLITE_OK )
 	{
 		i_error("FTS Xapian: Can not execute (%s) : %s",createDictTable,zErrMsg);
 		if(zErrMsg!=NULL) sqlite3_free(zErrMsg);
-		sqlite3_close(backend->ddb);
-		backend->ddb = NULL;
-		return FALSE;
+		sqlite3_close(db);
+		return NULL;
+	}
+
+	zErrMsg =0;
+	if(sqlite3_exec(db,createDictIndexes,NULL,0,&zErrMsg) != SQLITE_OK )
+	{
+		i_error("FTS Xapian: Can not execute (%s) : %s",createDictIndexes,zErrMsg);
+		if(zErrMsg!=NULL) sqlite3_free(zErrMsg);
+		sqlite3_close(db);
+		return NULL;
+	}
+	return db;
+}
+
+static bool fts_backend_xapian_sqlite3_dict_open(struct xapian_fts_backend *backend)
+{
+	if(backend->ddb!=NULL) return TRUE;
+
+	backend->ddb = fts_backend_xapian_sqlite3_dict_create(backend->dict_db);
+	return (backend->ddb != NULL);
+}
+
+static bool fts_backend_xapian_sqlite3_dict_flush(struct xapian_fts_backend *backend, int verbose,char *err_s=NULL)
+{
+	long n = backend->dict->size();
+	if(n<1) return TRUE;
+	if(backend->ddb==NULL) return FALSE;
+
+	long dt=fts_backend_xapian_current_time();
+	if(verbose>0) syslog(LOG_INFO,"FTS Xapian: Flushing Dictionnary : %ld terms",n);
+	if(!backend->dict->flush(backend->ddb,err_s)) return FALSE;
+	if(verbose>0) syslog(LOG_INFO,"FTS Xapian: Flushing Dictionnary : %ld terms done in %ld msec",n,fts_backend_xapian_current_time()-dt);
+	return TRUE;
+}
+
+// Deferred mode : the words of the written docs are swapped out under lock, and stored by the calling (main) thread
+static bool fts_backend_xapian_sqlite3_dict_commit(struct xapian_fts_backend *backend, int verbose, long min)
+{
+	fts_backend_xapian_get_lock(backend, verbose, "dict commit");
+	XDict * d = NULL;
+	if(backend->dict->size() > min)
+	{
+		d = backend->dict;
+		backend->dict = new XDict();
+	}
+	fts_backend_xapian_release_lock(backend, verbose, "dict commit");
+
+	if(d == NULL) return TRUE;
+
+	bool ok = false;
+	long dt=fts_backend_xapian_current_time();
+	if(verbose>0) i_info("FTS Xapian: Committing Dictionnary : %ld terms",d->size());
+	if(fts_backend_xapian_sqlite3_dict_open(backend)) ok = d->flush(backend->ddb,NULL);
+	if(verbose>0) i_info("FTS Xapian: Committing Dictionnary done in %ld msec",fts_backend_xapian_current_time()-dt);
+	delete(d);
+	return ok;
+}
+
+static bool fts_backend_xapian_sqlite3_dict_rebuild(Xapian::Database * dbx, const char * path, int verbose)
+{
+	sqlite3 * db = fts_backend_xapian_sqlite3_dict_create(path);
+	if(db == NULL) return FALSE;
+
+	if(verbose>0) i_info("FTS Xapian: Rebuilding dictionnary %s from the terms",path);
+
+	XDict d;
+	bool ok=true;
+	for(long h=1;(h<HDRS_NB-1) && ok;h++)
+	{
+		long l = strlen(hdrs_xapian[h]);
+		try
+		{
+			Xapian::TermIterator t = dbx->allterms_begin(hdrs_xapian[h]);
+			while(t != dbx->allterms_end(hdrs_xapian[h]))
+			{
+				d.add(h,(*t).substr(l));
+				if((d.size() > XAPIAN_DICT_MAX) && (!d.flush(db,NULL))) ok=false;
+				t++;
+			}
+		}
+		catch(Xapian::Error e)
+		{
+			i_error("FTS Xapian: Can not rebuild dictionnary %s : %s",path,e.get_msg().c_str());
+			ok=false;
+		}
+	}
+	if(ok) ok = d.flush(db,NULL);
+	sqlite3_close(db);
+	return ok;
+}
+
+// Removes the words of the dictionnary which are not indexed anymore (expunged or replaced docs)
+// The caller holds the write lock of the Xapian DB, and the dictionnary is locked from the listing to the deletion :
+// a word absent from the terms then can not be one of a doc being written by another process
+static long fts_backend_xapian_sqlite3_dict_sweep(Xapian::WritableDatabase * dbx, const char * path, int verbose)
+{
+	sqlite3 * db = fts_backend_xapian_sqlite3_dict_create(path);
+	if(db == NULL) return -1;
+
+	long dt=fts_backend_xapian_current_time();
+	std::vector<std::pair<std::string,long>> orphans;
+	sqlite3_stmt * stmt = NULL;
+	long n=0;
+	char * zErrMsg = 0;
+
+	if(sqlite3_exec(db,"BEGIN IMMEDIATE TRANSACTION;",NULL,0,&zErrMsg) != SQLITE_OK)
+	{
+		i_warning("FTS Xapian: Dictionnary %s busy, not swept : %s",path,zErrMsg);
+		if(zErrMsg!=NULL) sqlite3_free(zErrMsg);
+		sqlite3_close(db);
+		return 0;
+	}
+	if(sqlite3_prepare_v2(db,selectDictWords,-1,&stmt,NULL) != SQLITE_OK)
+	{
+		i_error("FTS Xapian: Can not prepare (%s) : %s",selectDictWords,sqlite3_errmsg(db));
+		sqlite3_exec(db,"ROLLBACK;",NULL,0,NULL);
+		sqlite3_close(db);
+		return -1;
+	}
+	try
+	{
+		while(sqlite3_step(stmt) == SQLITE_ROW)
+		{
+			n++;
+			const char * k = (const char *)sqlite3_column_text(stmt,0);
+			long h = sqlite3_column_int(stmt,1);
+			if((k==NULL) || (h<0) || (h>=HDRS_NB)) continue;
+			std::string term(hdrs_xapian[h]);
+			term.append(k);
+			if(!dbx->term_exists(term)) orphans.push_back(std::make_pair(std::string(k),h));
+		}
+	}
+	catch(Xapian::Error e)
+	{
+		i_error("FTS Xapian: Can not sweep dictionnary %s : %s",path,e.get_msg().c_str());
+		orphans.clear();
+	}
+	sqlite3_finalize(stmt);
+
+	if(verbose>0) i_info("FTS Xapian: Dictionnary %s : %ld orphans out of %ld words",path,(long)orphans.size(),n);
+
+	{
+		bool ok = true;
+		stmt = NULL;
+		if(orphans.size()>0) ok = (sqlite3_prepare_v2(db,deleteDictWord,-1,&stmt,NULL) == SQLITE_OK);
+		for(auto & o : orphans)
+		{
+			if(!ok) break;
+			sqlite3_bind_text(stmt,1,o.first.c_str(),o.first.length(),SQLITE_STATIC);
+			sqlite3_bind_int(stmt,2,o.second);
+			if(sqlite3_step(stmt) != SQLITE_DONE) ok=false;
+			sqlite3_reset(stmt);
+		}
+		if(stmt!=NULL) sqlite3_finalize(stmt);
+		if(sqlite3_exec(db,ok ? "COMMIT;" : "ROLLBACK;",NULL,0,&zErrMsg) != SQLITE_OK) ok=false;
+		if(!ok)
+		{
+			i_error("FTS Xapian: Can not delete orphans from %s : %s",path,(zErrMsg!=NULL) ? zErrMsg : sqlite3_errmsg(db));
+			if(zErrMsg!=NULL) sqlite3_free(zErrMsg);
+			sqlite3_close(db);
+			return -1;
+		}
+
+		zErrMsg = 0;
+		if((orphans.size()>0) && (sqlite3_exec(db,vacuumDict,NULL,0,&zErrMsg) != SQLITE_OK))
+		{
+			i_warning("FTS Xapian: Can not execute (%s) on %s : %s",vacuumDict,path,zErrMsg);
+			if(zErrMsg!=NULL) sqlite3_free(zErrMsg);
+		}
+	}
+	sqlite3_close(db);
+
+	if(verbose>0) i_info("FTS Xapian: Dictionnary %s swept in %ld msec",path,fts_backend_xapian_current_time()-dt);
+	return orphans.size();
+}
+
+class XResultSet
+{
+	public:
+	long size;
+	Xapian::docid * data;
+	bool truncated;
+
+	XResultSet() { size=0; data=NULL; truncated=false; }
+	~XResultSet() { if (size>0) { i_free(data); } }
+
+	void add(Xapian::docid did)
+	{
+		if(data==NULL)
+		{
+			data=(Xapian::docid *)i_malloc(sizeof(Xapian::docid));
+		}
+		else
+		{
+			data=(Xapian::docid *)i_realloc(data,size*sizeof(Xapian::docid),(size+1)*sizeof(Xapian::docid));
+		}
+		data[size]=did;
+		size++;
+	}
+};
+
+class XQueryCacheEntry
+{
+	public:
+		std::string key;
+		std::string guid;
+		std::vector<std::pair<uint32_t,uint32_t>> definite;
+		std::vector<std::pair<uint32_t,uint32_t>> maybe;
+};
+
+// LRU cache of the search results, only valid for a given revision of each mailbox
+class XQueryCache
+{
+	private:
+		std::list<XQueryCacheEntry> entries;
+		std::unordered_map<std::string,std::list<XQueryCacheEntry>::iterator> index;
+		std::unordered_map<std::string,std::string> revisions;
+
+		static void ranges_get(ARRAY_TYPE(seq_range) * a, std::vector<std::pair<uint32_t,uint32_t>> * v)
+		{
+			unsigned int count;
+			const struct seq_range * r = array_get(a, &count);
+			for(unsigned int i=0;i<count;i++) v->push_back(std::make_pair(r[i].seq1,r[i].seq2));
+		}
+
+		static void ranges_set(std::vector<std::pair<uint32_t,uint32_t>> * v, ARRAY_TYPE(seq_range) * a)
+		{
+			for(auto & r : *v) seq_range_array_add_range(a,r.first,r.second);
+		}
+
+	public:
+		long hits, misses;
+
+	XQueryCache() { hits=0; misses=0; }
+
+	// Entries of a mailbox are dropped as soon as its revision changes
+	void validate(const char * guid, const std::string & rev)
+	{
+		auto r = revisions.find(guid);
+		if((r != revisions.end()) && (r->second == rev)) return;
+
+		auto e = entries.begin();
+		while(e != entries.end())
+		{
+			if(e->guid == guid)
+			{
+				index.erase(e->key);
+				e = entries.erase(e);
+			}
+			else e++;
+		}
+		revisions[guid] = rev;
+	}
+
+	bool get(const std::string & key, struct fts_result * result)
+	{
+		auto i = index.find(key);
+		if(i == index.end())
+		{
+			misses++;
+			return false;
+		}
+		hits++;
+		entries.splice(entries.begin(),entries,i->second);
+		i_array_init(&(result->definite_uids),i->second->definite.size());
+		ranges_set(&(i->second->definite),&(result->definite_uids));
+		ranges_set(&(i->second->maybe),&(result->maybe_uids));
+		return true;
+	}
+
+	// Only complete results are kept : those left to Dovecot for verification depend on the time budget
+	void put(const std::string & key, const char * guid, struct fts_result * result, unsigned long capacity)
+	{
+		if((capacity<1) || (index.find(key) != index.end()) || (array_count(&(result->maybe_uids))>0)) return;
+
+		XQueryCacheEntry e;
+		e.key = key;
+		e.guid = guid;
+		ranges_get(&(result->definite_uids),&(e.definite));
+		ranges_get(&(result->maybe_uids),&(e.maybe));
+		entries.push_front(e);
+		index[key] = entries.begin();
+
+		while(entries.size() > capacity)
+		{
+			index.erase(entries.back().key);
+			entries.pop_back();
+		}
+	}
+};
+
+static XQueryCache fts_xapian_querycache;
+
+
+// Generation of the expunges of a mailbox, shared by all the processes through the expunges DB
+static std::string fts_backend_xapian_expunges_generation(struct xapian_fts_backend *backend)
+{
+	std::string g("-");
+	sqlite3 * db = NULL;
+	sqlite3_stmt * stmt = NULL;
+	if((sqlite3_open_v2(backend->exp_db,&db,SQLITE_OPEN_FULLMUTEX | SQLITE_OPEN_READONLY,NULL) == SQLITE_OK) && (sqlite3_prepare_v2(db,countExpUIDs,-1,&stmt,NULL) == SQLITE_OK))
+	{
+		if(sqlite3_step(stmt) == SQLITE_ROW) g = std::to_string(sqlite3_column_int64(stmt,0)) + "/" + std::to_string(sqlite3_column_int64(stmt,1));
+	}
+	if(stmt != NULL) sqlite3_finalize(stmt);
+	sqlite3_close(db);
+	return g;
+}
+
+class XTermsCacheEntry
+{
+	public:
+		std::string key;
+		std::string owner; // index folder of the user
+		std::vector<std::string> terms; // sorted, with their header prefix
+		std::vector<std::pair<long,std::string>> words;
+		std::vector<uint64_t> grams;
+};
+
+// Key of a content in the terms caches, shared by the users of the process and saved on disk : SHA-256
+static std::string fts_backend_xapian_digest_key(const char * a, size_t len)
+{
+	static const char * hex = "0123456789abcdef";
+	unsigned char d[SHA256_RESULTLEN];
+	sha256_get_digest(a,len,d);
+
+	std::string k;
+	k.reserve(SHA256_RESULTLEN*2+24);
+	for(long i=0;i<SHA256_RESULTLEN;i++)
+	{
+		k.push_back(hex[d[i] >> 4]);
+		k.push_back(hex[d[i] & 15]);
+	}
+	return k + "_" + std::to_string(len);
+}
+
+// Terms of the last tokenized contents (messages or attachments) : a copy is not tokenized again
+class XTermsCache
+{
+	private:
+		std::mutex m;
+		std::list<XTermsCacheEntry> entries;
+		std::unordered_map<std::string,std::list<XTermsCacheEntry>::iterator> index;
+		long nterms;
+
+		static bool write_string(FILE * f, const std::string & s)
+		{
+			uint32_t l = s.length();
+			return (fwrite(&l,sizeof(l),1,f) == 1) && (fwrite(s.data(),1,l,f) == l);
+		}
+
+		static bool read_string(FILE * f, std::string & s)
+		{
+			uint32_t l;
+			if((fread(&l,sizeof(l),1,f) != 1) || (l > XAPIAN_LARGE_DOC)) return false;
+			s.resize(l);
+			return (fread(&(s[0]),1,l,f) == l);
+		}
+
+	public:
+		long hits, misses;
+
+	XTermsCache() { nterms=0; hits=0; misses=0; }
+
+	bool get(const std::string & key, XTermsCacheEntry & e)
+	{
+		std::lock_guard<std::mutex> lck(m);
+
+		auto i = index.find(key);
+		if(i == index.end())
+		{
+			misses++;
+			return false;
+		}
+		hits++;
+		entries.splice(entries.begin(),entries,i->second);
+		e = *(i->second);
+		return true;
+	}
+
+	void put(XTermsCacheEntry & e, unsigned long capacity)
+	{
+		std::lock_guard<std::mutex> lck(m);
+
+		if((capacity<1) || (index.find(e.key) != index.end())) return;
+
+		nterms += e.terms.size();
+		entries.push_front(std::move(e));
+		index[entries.front().key] = entries.begin();
+
+		while((entries.size() > capacity) || ((nterms > XAPIAN_TERMSCACHE_MAX) && (entries.size() > 0)))
+		{
+			nterms -= entries.back().terms.size();
+			index.erase(entries.back().key);
+			entries.pop_back();
+		}
+	}
+
+	// Only the entries of the user go to its file, the most recent last
+	bool save(const char * path, const char * owner)
+	{
+		std::lock_guard<std::mutex> lck(m);
+
+		std::string tmp(path);
+		tmp.append(".tmp");
+		FILE * f = fopen(tmp.c_str(),"w");
+		if(f == NULL) return false;
+		bool ok = (fwrite(XAPIAN_TERMSCACHE_MAGIC,1,sizeof(XAPIAN_TERMSCACHE_MAGIC),f) == sizeof(XAPIAN_TERMSCACHE_MAGIC));
+		for(auto e = entries.rbegin(); ok && (e != entries.rend()); e++)
+		{
+			if(e->owner != owner) continue;
+			uint32_t n;
+			ok = write_string(f,e->key);
+			n = e->terms.size();
+			if(ok) ok = (fwrite(&n,sizeof(n),1,f) == 1);
+			for(unsigned long i=0; ok && (i<n); i++) ok = write_string(f,e->terms[i]);
+			n = e->words.size();
+			if(ok) ok = (fwrite(&n,sizeof(n),1,f) == 1);
+			for(unsigned long i=0; ok && (i<n); i++)
+			{
+				int32_t h = e->words[i].first;
+				ok = (fwrite(&h,sizeof(h),1,f) == 1) && write_string(f,e->words[i].second);
+			}
+			n = e->grams.size();
+			if(ok) ok = (fwrite(&n,sizeof(n),1,f) == 1) && (fwrite(e->grams.data(),sizeof(uint64_t),n,f) == n);
+		}
+		if(fclose(f)!=0) ok=false;
+		if(ok) ok = (rename(tmp.c_str(),path)==0);
+		if(!ok)
+		{
+			syslog(LOG_ERR,"FTS Xapian: Can not write cache %s",path);
+			unlink(tmp.c_str());
+		}
+		return ok;
+	}
+
+	bool load(const char * path, const char * owner, unsigned long capacity)
+	{
+		FILE * f = fopen(path,"r");
+		if(f == NULL) return false;
+		char magic[sizeof(XAPIAN_TERMSCACHE_MAGIC)];
+		bool ok = (fread(magic,1,sizeof(magic),f) == sizeof(magic)) && (memcmp(magic,XAPIAN_TERMSCACHE_MAGIC,sizeof(magic))==0);
+		while(ok)
+		{
+			XTermsCacheEntry e;
+			uint32_t n;
+			e.owner = owner;
+			if(!read_string(f,e.key)) break;
+			ok = (fread(&n,sizeof(n),1,f) == 1) && (n <= XAPIAN_MAXTERMS_PERDOC);
+			if(ok) e.terms.resize(n);
+			for(unsigned long i=0; ok && (i<n); i++) ok = read_string(f,e.terms[i]);
+			if(ok) ok = (fread(&n,sizeof(n),1,f) == 1) && (n <= XAPIAN_MAXTERMS_PERDOC);
+			if(ok) e.words.resize(n);
+			for(unsigned long i=0; ok && (i<n); i++)
+			{
+				int32_t h;
+				ok = (fread(&h,sizeof(h),1,f) == 1) && (h>=0) && (h<HDRS_NB) && read_string(f,e.words[i].second);
+				e.words[i].first = h;
+			}
+			if(ok) ok = (fread(&n,sizeof(n),1,f) == 1) && (n <= XAPIAN_MAXTERMS_PERDOC * XAPIAN_TERM_SIZELIMIT);
+			if(ok) e.grams.resize(n);
+			if(ok) ok = (fread(e.grams.data(),sizeof(uint64_t),n,f) == n);
+			if(ok) put(e,capacity);
+		}
+		fclose(f);
+		return ok;
+	}
+};
+
+static XTermsCache fts_xapian_termscache;
+static XTermsCache fts_xapian_attachcache;
+
+// Streaming HTML to text : tags and comments become spaces, entities are decoded, style and script contents are skipped
+class XHtml
+{
+	private:
+		enum { TEXT, TAG, COMMENT, ENTITY, SKIP } state;
+		std::string name; // of the current tag, lowercase
+		bool named;
+		char quote;
+		std::string entity;
+		const char * end; // closing sequence looked for (comment, style or script)
+		long match;
+
+	static void utf8(unsigned long c, std::string & out)
+	{
+		if(c < 0x80) out.push_back(c);
+		else if(c < 0x800) { out.push_back(0xC0 | (c >> 6)); out.push_back(0x80 | (c & 0x3F)); }
+		else if(c < 0x10000) { out.push_back(0xE0 | (c >> 12)); out.push_back(0x80 | ((c >> 6) & 0x3F)); out.push_back(0x80 | (c & 0x3F)); }
+		else if(c < 0x110000) { out.push_back(0xF0 | (c >> 18)); out.push_back(0x80 | ((c >> 12) & 0x3F)); out.push_back(0x80 | ((c >> 6) & 0x3F)); out.push_back(0x80 | (c & 0x3F)); }
+	}
+
+	void entity_end(std::string & out)
+	{
+		unsigned long c = 0;
+		if((entity.length()>1) && (entity[0]=='#'))
+		{
+			if((entity[1]=='x') || (entity[1]=='X')) c = strtoul(entity.c_str()+2,NULL,16);
+			else c = strtoul(entity.c_str()+1,NULL,10);
+		}
+		else if(entity == "amp") c = '&';
+		else if(entity == "lt") c = '<';
+		else if(entity == "gt") c = '>';
+		else if(entity == "quot") c = '"';
+		else if(entity == "apos") c = '\'';
+		if(c > 0) utf8(c,out);
+		else out.push_back(' '); // nbsp and all the others
+		entity.clear();
+	}
+
+	void tag_start(const char * n)
+	{
+		state=TAG;
+		name.assign(n);
+		named=(n[0]!=0);
+		quote=0;
+	}
+
+	public:
+
+	XHtml()
+	{
+		state=TEXT;
+		named=false;
+		quote=0;
+		end=NULL;
+		match=0;
+	}
+
+	void strip(const char * d, size_t size, std::string & out)
+	{
+		for(size_t i=0;i<size;i++)
+		{
+			unsigned char c = d[i];
+			unsigned char l = tolower(c);
+			switch(state)
+			{
+				case TEXT:
+					if(c=='<') tag_start("");
+					else if(c=='&') { state=ENTITY; entity.clear(); }
+					else out.push_back(c);
+					break;
+				case ENTITY:
+					if(c==';')
+					{
+						entity_end(out);
+						state=TEXT;
+					}
+					else if((entity.length()<10) && (isalnum(c) || (c=='#'))) entity.push_back(c);
+					else
+					{
+						out.push_back('&'); out.append(entity); entity.clear();
+						state=TEXT; i--;
+					}
+					break;
+				case TAG:
+					if(quote!=0)
+					{
+						if(c==quote) quote=0;
+						break;
+					}
+					if(!named)
+					{
+						// A tag starts with a letter, '/' and a letter, or '!' : "x<5" or "a <-- b" are text
+						bool letter = (l>='a') && (l<='z');
+						bool ok;
+						if(name.length()<1) ok = letter || (c=='/') || (c=='!');
+						else if(name=="/") ok = letter;
+						else ok = (name.length()<10) && (letter || isdigit(c) || (c=='-'));
+						if(ok)
+						{
+							name.push_back(l);
+							if(name=="!--") { state=COMMENT; end="-->"; match=0; }
+							break;
+						}
+						if((name.length()<1) || (name=="/")) // Not a tag : '<' in the text
+						{
+							out.push_back('<');
+							out.append(name);
+							state=TEXT; i--;
+							break;
+						}
+						named=true;
+					}
+					if((c=='"') || (c=='\'')) quote=c;
+					else if(c=='>')
+					{
+						out.push_back(' ');
+						state=TEXT;
+						if(name=="style") { state=SKIP; end="</style"; match=0; }
+						else if(name=="script") { state=SKIP; end="</script"; match=0; }
+					}
+					break;
+				case COMMENT:
+				case SKIP:
+					if(l==end[match]) match++;
+					else if(match>0)
+					{
+						// Longest tail of what was read which still starts the sequence : "--->" ends a comment
+						std::string r(end,match);
+						r.push_back(l);
+						match=0;
+						for(long k=r.length()-1;k>0;k--)
+						{
+							if(r.compare(r.length()-k,k,end,k)==0) { match=k; break; }
+						}
+					}
+					else match = (l==end[0]) ? 1 : 0;
+					if(end[match]==0)
+					{
+						if(state==COMMENT)
+						{
+							out.push_back(' ');
+							state=TEXT;
+						}
+						else tag_start("/");
+					}
+					break;
+			}
+		}
 	}
+};
 
-	zErrMsg =0;
-	if(sqlite3_exec(backend->ddb,createDictIndexes,NULL,0,&zErrMsg) != SQLITE_OK )
-	{
-		i_error("FTS Xapian: Can not execute (%s) : %s",createDictIndexes,zErrMsg);
-		if(zErrMsg!=NULL) sqlite3_free(zErrMsg);
-		sqlite3_close(backend->ddb);
-		backend->ddb = NULL;
-		return FALSE;
-	}
+// Quoted reply text : lines starting with '>' and the "On ... wrote:" line introducing them are left out
+class XQuotes
+{
+	private:
+		enum { START, LINE, LONG, QUOTED } state;
+		std::string line; // kept until its end, to check for the reply marker
 
-	zErrMsg =0;
-	if(sqlite3_exec(backend->ddb,createTmpTable,NULL,0,&zErrMsg) != SQLITE_OK )
+	void line_end(std::string & out)
 	{
-		i_error("FTS Xapian: Can not execute (%s) : %s",createTmpTable,zErrMsg);
-		if(zErrMsg!=NULL) sqlite3_free(zErrMsg);
-		sqlite3_close(backend->ddb);
-		backend->ddb = NULL;
-		return FALSE;
+		size_t e = line.find_last_not_of(" \t\r\n");
+		if((e != std::string::npos) && (e >= 8) && (line.compare(e-5,6,"wrote:")==0))
+		{
+			size_t b = line.find_first_not_of(" \t");
+			if(line.compare(b,3,"On ")==0)
+			{
+				dropped += line.length();
+				line.clear();
+				out.push_back('\n');
+				return;
+			}
+		}
+		out.append(line);
+		line.clear();
 	}
-	return TRUE;
-}
 
-static int fts_backend_xapian_sqlite3_dict_add(struct xapian_fts_backend *backend, long h, icu::UnicodeString *t)
-{
-	std::string sql;
-	sql.clear();
-	t->toUTF8String(sql);
-	sql=replaceTmpWord + sql + "', " + std::to_string(h) + ", " + std::to_string(sql.length()) + ");";
+	public:
+		long dropped; // bytes
 
-	char * zErrMsg = 0;
-	if(sqlite3_exec(backend->ddb,sql.c_str(),NULL,0,&zErrMsg) != SQLITE_OK )
+	XQuotes()
 	{
-		syslog(LOG_ERR,"FTS Xapian: Can not replace keyword (%s) : %s",sql.c_str(),zErrMsg);
-		if(zErrMsg!=NULL) sqlite3_free(zErrMsg);
-		return 1;
+		state=START;
+		dropped=0;
 	}
-	backend->dict_nb++;
-	return 0;
-}
-
-static bool fts_backend_xapian_sqlite3_dict_flush(struct xapian_fts_backend *backend, int verbose,char *err_s=NULL)
-{
-	if(backend->dict_nb<1) return TRUE;
 
-	long dt=fts_backend_xapian_current_time();
-	if(verbose>0) syslog(LOG_INFO,"FTS Xapian: Flushing Dictionnary : %ld terms",backend->dict_nb);
-	char * zErrMsg = 0;
-	if(sqlite3_exec(backend->ddb,flushTmpWords,NULL,0,&zErrMsg) != SQLITE_OK )
+	void filter(const char * d, size_t size, std::string & out)
 	{
-		syslog(LOG_ERR,"FTS Xapian: Can not execute (%s) : %s",flushTmpWords,zErrMsg);
-		if(err_s!=NULL) 
+		for(size_t i=0;i<size;i++)
 		{
-			sprintf(err_s,"FTS Xapian: Can not execute (%s) : %s",flushTmpWords,zErrMsg);
+			char c = d[i];
+			switch(state)
+			{
+				case START:
+					if((c==' ') || (c=='\t')) { line.push_back(c); break; }
+					if(c=='>')
+					{
+						dropped += line.length() + 1;
+						line.clear();
+						state=QUOTED;
+						break;
+					}
+					state=LINE;
+					// fall through
+				case LINE:
+					line.push_back(c);
+					if(c=='\n')
+					{
+						line_end(out);
+						state=START;
+					}
+					else if(line.length() > XAPIAN_QUOTES_LINE)
+					{
+						out.append(line);
+						line.clear();
+						state=LONG;
+					}
+					break;
+				case LONG:
+					out.push_back(c);
+					if(c=='\n') state=START;
+					break;
+				case QUOTED:
+					dropped++;
+					if(c=='\n')
+					{
+						out.push_back(c);
+						state=START;
+					}
+					break;
+			}
 		}
-		if(zErrMsg!=NULL) sqlite3_free(zErrMsg);
-		return FALSE;
 	}
-	if(verbose>0) syslog(LOG_INFO,"FTS Xapian: Flushing Dictionnary : %ld terms done in %ld msec",backend->dict_nb,fts_backend_xapian_current_time()-dt);
-	backend->dict_nb = 0;
-	return TRUE;
-}
-
-class XResultSet
-{
-	public:
-	long size;
-	Xapian::docid * data;
-
-	XResultSet() { size=0; data=NULL; }
-	~XResultSet() { if (size>0) { i_free(data); } }
 
-	void add(Xapian::docid did)
+	void flush(std::string & out)
 	{
-		if(data==NULL)
-		{
-			data=(Xapian::docid *)i_malloc(sizeof(Xapian::docid));
-		}
-		else
-		{
-			data=(Xapian::docid *)i_realloc(data,size*sizeof(Xapian::docid),(size+1)*sizeof(Xapian::docid));
-		}
-		data[size]=did;
-		size++;
+		if(state==LINE) line_end(out);
+		else out.append(line);
+		line.clear();
+		state=START;
 	}
 };
 
+static long fts_xapian_quotes_dropped = 0;
+
 class XQuerySet
 {
 	private:
@@ -359,7 +1234,10 @@ class XQuerySet
 		XQuerySet ** qs;
 		Xapian::Query::op global_op;
 		bool item_neg; // for the term
+		bool neg; // for the whole set
+		bool nothing; // a required word has no match
 		long qsize;
+		std::vector<std::vector<std::pair<uint32_t,uint32_t>>> uids; // UID filters, all must match
 
 	public:
 		long limit;
@@ -370,6 +1248,8 @@ class XQuerySet
 		limit=1;
 		header=-1;
 		text=NULL;
+		neg=false;
+		nothing=false;
 		global_op = Xapian::Query::op::OP_OR;
 	}
 
@@ -380,6 +1260,8 @@ class XQuerySet
 		if(l>limit) { limit=l; }
 		header=-1;
 		text=NULL;
+		neg=false;
+		nothing=false;
 		global_op=op;
 	}
 
@@ -419,14 +1301,8 @@ class XQuerySet
 		i = t->lastIndexOf(CHAR_SPACE);
 		if(i>0)
 		{
-			if(is_neg)
-			{
-				q2 = new XQuerySet(Xapian::Query::OP_AND_NOT,limit);
-			}
-			else
-			{
-				q2 = new XQuerySet(Xapian::Query::OP_AND,limit);
-			}
+			q2 = new XQuerySet(Xapian::Query::OP_AND,limit);
+			if(is_neg) q2->negate();
 			while(i>0)
 			{
 				j = t->length();
@@ -444,14 +1320,8 @@ class XQuerySet
 
 		if(h<0)
 		{
-			if(is_neg)
-			{
-				q2 = new XQuerySet(Xapian::Query::OP_AND_NOT,limit);
-			}
-			else
-			{
-				q2 = new XQuerySet(Xapian::Query::OP_OR,limit);
-			}
+			q2 = new XQuerySet(Xapian::Query::OP_OR,limit);
+			if(is_neg) q2->negate();
 			for(i=1;i<HDRS_NB-1;i++)
 			{
 				q2->add(i,t,false);
@@ -469,10 +1339,206 @@ class XQuerySet
 		}
 
 		q2 = new XQuerySet(Xapian::Query::OP_AND,limit);
-		q2->add(h,t,is_neg);
+		q2->add(h,t,false);
+		if(is_neg) q2->negate();
 		add(q2);
 	}
 
+	void negate()
+	{
+		neg=!neg;
+	}
+
+	void match_nothing()
+	{
+		nothing=true;
+	}
+
+	bool matches_nothing()
+	{
+		return nothing && (!neg);
+	}
+
+	bool matches_all()
+	{
+		return nothing && neg;
+	}
+
+	// Planning : drops the operands that can not change the result, orders the AND operands
+	// from the rarest (using the term frequencies) and collapses the single-operand sets.
+	// Returns the estimated nb of docs matching the set.
+	long plan(Xapian::Database * db)
+	{
+		long total = 0, e = 0;
+		try
+		{
+			total = db->get_doccount();
+		}
+		catch(Xapian::Error e)
+		{
+			syslog(LOG_ERR,"FTS Xapian: plan %s",e.get_msg().c_str());
+			return 0;
+		}
+
+		bool was_neg = neg;
+		bool is_and = (global_op == Xapian::Query::OP_AND) || (global_op == Xapian::Query::OP_AND_NOT);
+		if((text!=NULL) && (qsize>0) && is_and)
+		{
+			// The term becomes an operand like the others, so it can be ordered
+			XQuerySet * q2 = new XQuerySet(Xapian::Query::OP_AND,limit);
+			q2->text=text; q2->header=header; q2->item_neg=item_neg;
+			text=NULL; header=-1;
+			add(q2);
+			for(long i=qsize-1;i>0;i--) qs[i]=qs[i-1];
+			qs[0]=q2;
+		}
+
+		if(!nothing)
+		{
+			if(text!=NULL)
+			{
+				std::string s(hdrs_xapian[header]);
+				text->toUTF8String(s);
+				try
+				{
+					e = db->get_termfreq(s);
+				}
+				catch(Xapian::Error e2)
+				{
+					e = total;
+				}
+				if(item_neg) e = total - e;
+			}
+			else if(global_op == Xapian::Query::OP_OR) e = 0; else e = total;
+
+			std::vector<std::pair<long,XQuerySet *>> ops;
+			long n=qsize;
+			for(long i=0;i<n;i++)
+			{
+				long f = qs[i]->plan(db);
+				bool keep = true;
+				if(global_op == Xapian::Query::OP_OR)
+				{
+					keep = !(qs[i]->matches_nothing());
+					if(keep) e = std::min(total, e+f);
+				}
+				else if((global_op == Xapian::Query::OP_AND) || (i==0))
+				{
+					if(qs[i]->matches_nothing()) nothing=true;
+					keep = !(qs[i]->matches_all()) || (global_op == Xapian::Query::OP_AND_NOT);
+					if(keep) e = std::min(e, f);
+				}
+				else // subtracted operand
+				{
+					if(qs[i]->matches_all()) nothing=true;
+					keep = !(qs[i]->matches_nothing());
+				}
+				if(keep) ops.push_back(std::make_pair(f,qs[i])); else delete(qs[i]);
+			}
+
+			// Rarest first, the first operand of AND_NOT stays in place
+			std::stable_sort(ops.begin() + ((global_op == Xapian::Query::OP_AND_NOT) && (ops.size()>0) ? 1 : 0), ops.end(),
+				[](const std::pair<long,XQuerySet *> & a, const std::pair<long,XQuerySet *> & b) { return a.first < b.first; });
+			qsize=0;
+			for(auto & op : ops) qs[qsize++]=op.second;
+
+			// Every alternative was dropped, or every required operand matches all
+			if((text==NULL) && (n>0) && (qsize<1) && (!nothing))
+			{
+				nothing=true;
+				if(global_op == Xapian::Query::OP_AND) neg=!neg;
+			}
+		}
+
+		if(nothing)
+		{
+			// Nothing to evaluate any more
+			for(long i=0;i<qsize;i++) delete(qs[i]);
+			qsize=0;
+			if(text!=NULL) { delete(text); text=NULL; }
+		}
+		else if((text==NULL) && (qsize==1) && (uids.size()<1))
+		{
+			XQuerySet * c = qs[0];
+			free(qs);
+			qs=c->qs; qsize=c->qsize;
+			text=c->text; header=c->header; item_neg=c->item_neg;
+			global_op=c->global_op;
+			neg=(neg != c->neg);
+			nothing=c->nothing;
+			uids=c->uids;
+			c->qs=NULL; c->qsize=0; c->text=NULL;
+			delete(c);
+		}
+		if(qsize<1)
+		{
+			if(qs!=NULL) free(qs);
+			qs=NULL; qsize=0;
+		}
+
+		if(nothing) return (neg ? total : 0);
+		if(was_neg) return total - e;
+		return e;
+	}
+
+	// Moves the negated args of this set into a new one, combined with op and without their negation
+	XQuerySet * split_negatives(Xapian::Query::op op)
+	{
+		XQuerySet * n = new XQuerySet(op,limit);
+		if((text!=NULL) && item_neg)
+		{
+			n->add(header,text,false);
+			delete(text);
+			text=NULL;
+			header=-1;
+		}
+		long j=0;
+		for(long i=0;i<qsize;i++)
+		{
+			if(qs[i]->neg)
+			{
+				qs[i]->neg=false;
+				n->add(qs[i]);
+			}
+			else qs[j++]=qs[i];
+		}
+		qsize=j;
+		if((qsize<1) && (qs!=NULL))
+		{
+			free(qs);
+			qs=NULL;
+		}
+		if(n->count()<1)
+		{
+			delete(n);
+			return NULL;
+		}
+		return n;
+	}
+
+	// Restricts the results to a UID set (only meaningful when all args must match)
+	bool restrict(const ARRAY_TYPE(seq_range) *seqset)
+	{
+		if(global_op != Xapian::Query::OP_AND) return false;
+
+		std::vector<std::pair<uint32_t,uint32_t>> ranges;
+		const struct seq_range *range;
+		array_foreach(seqset, range)
+		{
+			ranges.push_back(std::make_pair(range->seq1,range->seq2));
+		}
+		if(ranges.size()<1) return false;
+		if(ranges.size() > XAPIAN_UID_RANGES)
+		{
+			// Too fragmented : the enclosing range is enough as Dovecot checks the UIDs afterwards
+			uint32_t u1=ranges.front().first, u2=ranges.back().second;
+			ranges.clear();
+			ranges.push_back(std::make_pair(u1,u2));
+		}
+		uids.push_back(ranges);
+		return true;
+	}
+
 	void add(XQuerySet *q2)
 	{
 		if(qsize<1)
@@ -535,14 +1601,70 @@ class XQuerySet
 			}
 			else s.append(qs[i]->get_string());
 		}
+
+		for(auto & ranges : uids)
+		{
+			if(s.length()<1) break;
+			s.append(" AND uid:");
+			for(unsigned long i=0;i<ranges.size();i++)
+			{
+				if(i>0) s.append(",");
+				s.append(std::to_string(ranges[i].first));
+				if(ranges[i].second != ranges[i].first) s.append("-"+std::to_string(ranges[i].second));
+			}
+		}
+		if(neg && (s.length()>0)) s = "NOT ( " + s + ")";
 		return s;
 	}
 
 	Xapian::Query * get_query(Xapian::Database * db)
+	{
+		Xapian::Query * q = get_text_query(db);
+		Xapian::Query * q2;
+
+		// UID filters : value slot 1 holds the UID of the doc
+		for(auto & ranges : uids)
+		{
+			Xapian::Query * r = NULL;
+			for(auto & range : ranges)
+			{
+				Xapian::Query q3(Xapian::Query::OP_VALUE_RANGE,1,Xapian::sortable_serialise(range.first),Xapian::sortable_serialise(range.second));
+				if(r==NULL)
+				{
+					r = new Xapian::Query(q3);
+				}
+				else
+				{
+					q2 = new Xapian::Query(Xapian::Query::OP_OR,*r,q3);
+					delete(r);
+					r=q2;
+				}
+			}
+			q2 = new Xapian::Query(Xapian::Query::OP_FILTER,*q,*r);
+			delete(r);
+			delete(q);
+			q=q2;
+		}
+
+		// Nested negation : the top-level ones are split out by the lookup and never get here
+		if(neg)
+		{
+			q2 = new Xapian::Query(Xapian::Query::OP_AND_NOT,Xapian::Query(Xapian::Query::MatchAll),*q);
+			delete(q);
+			q=q2;
+		}
+		return q;
+	}
+
+	private:
+
+	Xapian::Query * get_text_query(Xapian::Database * db)
 	{
 		Xapian::Query * q = NULL;
 		Xapian::Query *q2, *q3;
 
+		if(nothing) return new Xapian::Query(Xapian::Query::MatchNothing);
+
 		if(text!=NULL)
 		{
 			std::string s(hdrs_query[header]);
@@ -566,61 +1688,282 @@ class XQuerySet
 		}
 		if(qsize<1)
 		{
-			if(q==NULL) q = new Xapian::Query(Xapian::Query::MatchNothing);
-			return q;
+			if(q==NULL) q = new Xapian::Query(Xapian::Query::MatchNothing);
+			return q;
+		}
+
+		if(q==NULL)
+		{	
+			q=qs[0]->get_query(db);
+		}
+		else
+		{
+			q2 = new Xapian::Query(global_op,*q,*(qs[0]->get_query(db)));
+			delete(q);
+			q=q2;
+		}
+		for (int i=1;i<qsize;i++)
+		{
+			q2 = new Xapian::Query(global_op,*q,*(qs[i]->get_query(db)));
+			delete(q);
+			q=q2;
+		}
+		return q;
+	}
+};
+
+// Trigrams of the indexed words : a missing trigram proves that no word contains a searched keyword
+class XBloom
+{
+	private:
+		std::vector<uint64_t> bits;
+
+		void set(uint64_t g)
+		{
+			uint64_t h2 = (g >> 33) | 1;
+			for(long k=0;k<XAPIAN_BLOOM_HASHES;k++)
+			{
+				uint64_t i = (g + k*h2) % XAPIAN_BLOOM_BITS;
+				bits[i >> 6] |= (1ULL << (i & 63));
+			}
+		}
+
+		bool test(uint64_t g)
+		{
+			uint64_t h2 = (g >> 33) | 1;
+			for(long k=0;k<XAPIAN_BLOOM_HASHES;k++)
+			{
+				uint64_t i = (g + k*h2) % XAPIAN_BLOOM_BITS;
+				if((bits[i >> 6] & (1ULL << (i & 63))) == 0) return false;
+			}
+			return true;
+		}
+
+	public:
+
+	XBloom() : bits(XAPIAN_BLOOM_BITS / 64, 0) {}
+
+	static uint64_t gram(icu::UnicodeString *w, long i)
+	{
+		uint64_t h = 14695981039346656037ULL; // FNV-1a, stable across processes
+		for(long j=i;j<i+3;j++)
+		{
+			UChar c = w->charAt(j);
+			h ^= (c & 0xFF); h *= 1099511628211ULL;
+			h ^= (c >> 8); h *= 1099511628211ULL;
+		}
+		return h;
+	}
+
+	static void grams(icu::UnicodeString *w, std::unordered_set<uint64_t> * g)
+	{
+		for(long i=0;i+3<=w->length();i++) g->insert(gram(w,i));
+	}
+
+	void add(const std::unordered_set<uint64_t> & g)
+	{
+		for(auto & x : g) set(x);
+	}
+
+	void add(icu::UnicodeString *w)
+	{
+		for(long i=0;i+3<=w->length();i++) set(gram(w,i));
+	}
+
+	bool may_contain(icu::UnicodeString *w)
+	{
+		for(long i=0;i+3<=w->length();i++)
+		{
+			if(!test(gram(w,i))) return false;
+		}
+		return true;
+	}
+
+	void merge(XBloom * b)
+	{
+		for(unsigned long i=0;i<bits.size();i++) bits[i] |= b->bits[i];
+	}
+
+	void clear()
+	{
+		std::fill(bits.begin(),bits.end(),0);
+	}
+
+	bool saturated()
+	{
+		long n=0;
+		for(auto & w : bits) n += __builtin_popcountll(w);
+		return n > (long)(XAPIAN_BLOOM_FULL * XAPIAN_BLOOM_BITS);
+	}
+
+	bool load(const char * path)
+	{
+		FILE * f = fopen(path,"r");
+		if(f == NULL) return false;
+		char magic[sizeof(XAPIAN_BLOOM_MAGIC)];
+		bool ok = (fread(magic,1,sizeof(magic),f) == sizeof(magic)) && (memcmp(magic,XAPIAN_BLOOM_MAGIC,sizeof(magic))==0);
+		std::vector<uint64_t> b(bits.size(),0);
+		if(ok) ok = (fread(b.data(),sizeof(uint64_t),b.size(),f) == b.size());
+		fclose(f);
+		if(!ok) return false;
+		for(unsigned long i=0;i<bits.size();i++) bits[i] |= b[i];
+		return true;
+	}
+
+	// The filter is only valid if it covers all the docs : it is never created for a pre-existing DB, unless asked
+	bool save(const char * path, bool create)
+	{
+		struct stat sb;
+		if((!create) && (!( (stat(path, &sb)==0) && S_ISREG(sb.st_mode)))) return false;
+
+		XBloom b;
+		b.load(path);
+		b.merge(this);
+
+		// A saturated filter is dropped : without a file, the box is no longer filtered until it is rebuilt
+		if(b.saturated())
+		{
+			syslog(LOG_INFO,"FTS Xapian: Filter %s saturated, removed",path);
+			unlink(path);
+			return false;
 		}
 
-		if(q==NULL)
-		{	
-			q=qs[0]->get_query(db);
+		std::string tmp(path);
+		tmp.append(".tmp");
+		FILE * f = fopen(tmp.c_str(),"w");
+		if(f == NULL) return false;
+		bool ok = (fwrite(XAPIAN_BLOOM_MAGIC,1,sizeof(XAPIAN_BLOOM_MAGIC),f) == sizeof(XAPIAN_BLOOM_MAGIC));
+		if(ok) ok = (fwrite(b.bits.data(),sizeof(uint64_t),b.bits.size(),f) == b.bits.size());
+		if(fclose(f)!=0) ok=false;
+		if(ok) ok = (rename(tmp.c_str(),path)==0);
+		if(!ok)
+		{
+			syslog(LOG_ERR,"FTS Xapian: Can not write filter %s",path);
+			unlink(tmp.c_str());
 		}
-		else
+		return ok;
+	}
+};
+
+static bool fts_backend_xapian_bloom_fill(Xapian::Database * dbx, XBloom * b, const char * path)
+{
+	for(long h=1;h<HDRS_NB-1;h++)
+	{
+		long l = strlen(hdrs_xapian[h]);
+		try
 		{
-			q2 = new Xapian::Query(global_op,*q,*(qs[0]->get_query(db)));
-			delete(q);
-			q=q2;
+			Xapian::TermIterator t = dbx->allterms_begin(hdrs_xapian[h]);
+			while(t != dbx->allterms_end(hdrs_xapian[h]))
+			{
+				icu::UnicodeString w = icu::UnicodeString::fromUTF8(icu::StringPiece((*t).substr(l)));
+				b->add(&w);
+				t++;
+			}
 		}
-		for (int i=1;i<qsize;i++)
+		catch(Xapian::Error e)
 		{
-			q2 = new Xapian::Query(global_op,*q,*(qs[i]->get_query(db)));
-			delete(q);
-			q=q2;
+			i_error("FTS Xapian: Can not rebuild filter %s : %s",path,e.get_msg().c_str());
+			return false;
 		}
-		return q;
 	}
+	return true;
+}
+
+static void fts_backend_xapian_bloom_rebuild(Xapian::Database * dbx, const char * path, int verbose)
+{
+	if(verbose>0) i_info("FTS Xapian: Rebuilding filter %s from the terms",path);
+
+	XBloom b;
+	if(!fts_backend_xapian_bloom_fill(dbx,&b,path)) return;
+	std::filesystem::remove(path);
+	b.save(path,true);
+}
+
+class XDoc;
+
+// Slice of a large email : whole parts of the arena (h<0), or a piece of a large part (header h)
+struct XSlice
+{
+	XDoc * shard;
+	XDict * dict;
+	const char * a;
+	size_t len;
+	int32_t h;
+	bool done;
 };
 
+static void fts_backend_xapian_pool_run(std::vector<XSlice *> & slices);
+
+// Length of a slice of a large part, of about target bytes : cut after a space, or between two UTF-8 chars
+static size_t fts_backend_xapian_word_cut(const char * a, size_t len, size_t target)
+{
+	size_t c = target;
+	while((c < len) && (c < target + XAPIAN_LARGE_CUT) && (a[c]!=' ') && (a[c]!='\n') && (a[c]!='\r') && (a[c]!='\t')) c++;
+	if(c >= len) return len;
+	if(c >= target + XAPIAN_LARGE_CUT)
+	{
+		c = target;
+		while((c < len) && ((a[c] & 0xC0) == 0x80)) c++;
+	}
+	return c;
+}
+
 class XDoc
 {
 	private:
 		std::vector<icu::UnicodeString *> * terms;
-		std::vector<icu::UnicodeString *> * strings;
-		std::vector<long> * headers;
-		struct xapian_fts_backend *backend;
+		char * arena; // raw parts, one after the other : header id, length, UTF-8 bytes
+		size_t arena_len, arena_size;
+		std::string carry; // stream mode : tail of the last chunk, not yet ended by a separator
+		long carry_h;
+		std::vector<std::pair<size_t,size_t>> parts; // attachments in the arena : offset, length
+		size_t part_off;
+		bool part_attach;
+		size_t part_bytes;
+		long fbytes[HDRS_NB], fterms[HDRS_NB]; // used from the field budgets
+		std::string owner; // index path of the user, for the shared caches
+
+	void arena_free()
+	{
+		if(arena!=NULL) free(arena);
+		arena=NULL;
+		arena_len=0;
+		arena_size=0;
+	}
 
 	public:
+		std::unordered_set<uint64_t> * grams;
 		long uid;
 		char * uterm;
 		Xapian::Document * xdoc;
 		long status;
 		long status_n;
 		long nterms,nlines,ndict;
+		XDict * words; // stream mode : words found while loading
+		off_t spool_off; // raw parts in the spool file if >=0
+		long spool_len;
  
-	XDoc(struct xapian_fts_backend *b)
+	XDoc(long u, const char * o)
 	{
-		backend=b;
-		uid=b->lastuid;
+		uid=u;
+		if(o != NULL) owner=o;
+		spool_off=-1;
+		spool_len=0;
 					 
 		std::string s="Q"+std::to_string(uid);
 		uterm = (char*)malloc((s.length()+1)*sizeof(char));
 		strcpy(uterm,s.c_str());
 
-		strings = new std::vector<icu::UnicodeString *>;
-		strings->clear();
-		headers = new std::vector<long>;
-		headers->clear();
+		arena=NULL; arena_len=0; arena_size=0;
+		carry_h=-1;
+		words=NULL;
+		part_off=0;
+		part_attach=false;
+		part_bytes=0;
+		for(long h=0;h<HDRS_NB;h++) { fbytes[h]=0; fterms[h]=0; }
 		terms = new std::vector<icu::UnicodeString *>;
 		terms->clear();
+		grams = new std::unordered_set<uint64_t>;
 		nterms=0; nlines=0; ndict=0;
 
 		xdoc=NULL; 
@@ -635,14 +1978,10 @@ class XDoc
 			delete(t);
 		}
 		terms->clear(); delete(terms);
+		delete(grams);
+		if(words!=NULL) delete(words);
 	
-		headers->clear(); delete(headers);
-
-		for(icu::UnicodeString * t : *strings)
-		{
-			delete(t);
-		}
-		strings->clear(); delete(strings);
+		arena_free();
 
 		if(xdoc!=NULL) delete(xdoc);
 		free(uterm);
@@ -661,15 +2000,71 @@ class XDoc
 		return s;
 	}
 
+	bool spooled()
+	{
+		return (spool_off>=0);
+	}
+
+	// Bytes still to tokenize
+	size_t size()
+	{
+		return spooled() ? (size_t)spool_len : arena_len;
+	}
+
+	// Overflow : the arena goes to the spool file as is, only the doc shell stays in memory
+	bool spill(int fd, off_t off)
+	{
+		if(pwrite(fd,arena,arena_len,off) != (ssize_t)arena_len) return false;
+
+		spool_off=off;
+		spool_len=arena_len;
+		arena_free();
+		return true;
+	}
+
+	bool unspill(int fd)
+	{
+		if(spool_off<0) return true;
+
+		arena_free();
+		arena = (char *)malloc(spool_len);
+		if(arena==NULL) return false;
+		if(pread(fd,arena,spool_len,spool_off) != (ssize_t)spool_len)
+		{
+			arena_free();
+			return false;
+		}
+		arena_len=spool_len;
+		arena_size=spool_len;
+		spool_off=-1;
+		spool_len=0;
+		return true;
+	}
+
+	// Raw parts are appended to the arena as received, the conversion is left to the writers
 	void raw_load(long h, const char *d, int32_t size, long verbose, const char * title)
 	{
-		icu::UnicodeString * t;
+		size = budget(h,d,size);
+		if(size<1) return;
+
+		int32_t h32 = h;
+		size_t n = sizeof(h32) + sizeof(size) + size;
+		if(arena_len + n > arena_size)
 		{
-			icu::StringPiece sp(d,size);
-			t =  new icu::UnicodeString(icu::UnicodeString::fromUTF8(sp));
+			size_t m = std::max(arena_size*2, arena_len + n);
+			m = std::max(m, (size_t)4096);
+			char * a = (char *)realloc(arena,m);
+			if(a==NULL)
+			{
+				if(verbose>0) syslog(LOG_ERR,"%sCan not store %d bytes for %s",title,size,getDocSummary().c_str());
+				return;
+			}
+			arena=a;
+			arena_size=m;
 		}
-		headers->push_back(h);
-		strings->push_back(t);
+		memcpy(arena+arena_len,&h32,sizeof(h32)); arena_len+=sizeof(h32);
+		memcpy(arena+arena_len,&size,sizeof(size)); arena_len+=sizeof(size);
+		memcpy(arena+arena_len,d,size); arena_len+=size;
 		nlines++;
 	}
 
@@ -695,9 +2090,31 @@ class XDoc
 		return terms_add(w,pos,n);
 	}
 
-	void terms_push(long h, icu::UnicodeString *t)
+	void terms_push(long h, icu::UnicodeString *t, XDict * dict)
 	{
 		fts_backend_xapian_trim(t);
+
+		if(fts_backend_xapian_junk_filter() && fts_backend_xapian_junk(t))
+		{
+			if(strcmp(fts_xapian_settings.junkmode,XAPIAN_JUNK_DROP)==0)
+			{
+				fts_xapian_junk_dropped++;
+				fts_xapian_junk_chars += t->length();
+				delete(t);
+				return;
+			}
+			fts_xapian_junk_truncated++;
+			fts_xapian_junk_chars += t->length() - fts_xapian_settings.junklength;
+			t->truncate(fts_xapian_settings.junklength);
+		}
+
+		// Budget of the field used up
+		if((fts_xapian_field_terms[h]>0) && (fterms[h]>=fts_xapian_field_terms[h]))
+		{
+			delete(t);
+			return;
+		}
+
 		unsigned long n = t->length();
 		long m = XAPIAN_TERM_SIZELIMIT - strlen(hdrs_xapian[h]) - 1;
 	
@@ -708,40 +2125,330 @@ class XDoc
 			{
 				t->truncate(t->length()-1);
 			}
-			fts_backend_xapian_sqlite3_dict_add(backend,h,t);
+			dict->add(h,t);
+			XBloom::grams(t,grams);
 			ndict++;
 			t->insert(0,hdrs_xapian[h]);
-			terms_add(t,0,terms->size());
+			unsigned long k = terms->size();
+			terms_add(t,0,k);
+			fterms[h] += terms->size() - k;
 		}
 		delete(t);
 	}
 
-	bool terms_create(long verbose, const char * title)
+	void terms_scan(const char * a, size_t len, XDict * dict)
 	{
-		icu::UnicodeString *t;
-		long h;
-		long k;
+		int32_t h, l;
+		size_t p = 0;
 		
-		while((terms->size()<XAPIAN_MAXTERMS_PERDOC) && (strings->size()>0))
+		while((terms->size()<XAPIAN_MAXTERMS_PERDOC) && (p + sizeof(h) + sizeof(l) <= len))
 		{
-			h = headers->back(); headers->pop_back();
-			t = strings->back(); strings->pop_back();
-			
-			fts_backend_xapian_clean(t);
+			memcpy(&h,a+p,sizeof(h)); p+=sizeof(h);
+			memcpy(&l,a+p,sizeof(l)); p+=sizeof(l);
+			if((l<0) || (p+l > len)) break;
+			terms_piece(h,a+p,l,dict);
+			p+=l;
+		}
+	}
 
-			k = t->lastIndexOf(CHAR_SPACE);
-			while(k>0)
+	void terms_piece(int32_t h, const char * a, size_t len, XDict * dict)
+	{
+		icu::StringPiece sp(a,(int32_t)len);
+		terms_split(h,new icu::UnicodeString(icu::UnicodeString::fromUTF8(sp)),dict);
+	}
+
+	// Large emails : the parts are cut in slices, the large parts between two words, which the idle
+	// writers of the pool tokenize meanwhile. The terms are merged afterwards
+	bool terms_parallel(long verbose, const char * title, XDict * dict)
+	{
+		long n = std::min(XAPIAN_LARGE_SPLIT, (long)(arena_len / XAPIAN_LARGE_DOC) + 1);
+		size_t target = arena_len / n;
+		std::vector<XSlice *> slices;
+		size_t p = 0, start = 0;
+		int32_t h, l;
+
+		while(p + sizeof(h) + sizeof(l) <= arena_len)
+		{
+			memcpy(&h,arena+p,sizeof(h));
+			memcpy(&l,arena+p+sizeof(h),sizeof(l));
+			size_t q = p + sizeof(h) + sizeof(l);
+			if((l<0) || (q + l > arena_len)) break;
+			size_t e = q + l;
+			if((size_t)l > target)
 			{
-				terms_push(h,new icu::UnicodeString(*t,k+1));
-				t->truncate(k);
-				fts_backend_xapian_trim(t);
-				k = t->lastIndexOf(CHAR_SPACE);
+				if(p > start) slice_add(slices,-1,arena+start,p-start);
+				while(q < e)
+				{
+					size_t c = fts_backend_xapian_word_cut(arena+q,e-q,target);
+					slice_add(slices,h,arena+q,c);
+					q += c;
+				}
+				start = e;
+			}
+			p = e;
+			if(p - start >= target)
+			{
+				slice_add(slices,-1,arena+start,p-start);
+				start = p;
+			}
+		}
+		if(p > start) slice_add(slices,-1,arena+start,p-start);
+		if(verbose>0) syslog(LOG_INFO,"%sTokenizing %ld bytes in %ld slices",title,(long)arena_len,(long)slices.size());
+
+		fts_backend_xapian_pool_run(slices);
+
+		std::vector<XDoc *> shards;
+		for(XSlice * s : slices)
+		{
+			dict->merge(s->dict);
+			delete(s->dict);
+			shards.push_back(s->shard);
+			delete(s);
+		}
+		terms_merge(shards);
+		return true;
+	}
+
+	void slice_add(std::vector<XSlice *> & slices, int32_t h, const char * a, size_t len)
+	{
+		XSlice * s = new XSlice();
+		s->shard = new XDoc(uid,owner.c_str());
+		s->dict = new XDict();
+		s->a = a;
+		s->len = len;
+		s->h = h;
+		s->done = false;
+		slices.push_back(s);
+	}
+
+	// The sorted terms of the shards join the ones of the doc, the shards are deleted
+	void terms_merge(std::vector<XDoc *> & shards)
+	{
+		if(shards.size()<1) return;
+
+		std::vector<icu::UnicodeString *> all(*terms);
+		terms->clear();
+		for(XDoc * s : shards)
+		{
+			all.insert(all.end(),s->terms->begin(),s->terms->end());
+			s->terms->clear();
+			grams->insert(s->grams->begin(),s->grams->end());
+			ndict += s->ndict;
+			delete(s);
+		}
+		shards.clear();
+
+		// The field budgets apply to the merged terms as well
+		bool budgets = false;
+		for(long h=0;h<HDRS_NB;h++) 
+		{
+			fterms[h] = 0;
+			if(fts_xapian_field_terms[h]>0) budgets = true;
+		}
+
+		std::sort(all.begin(),all.end(),[](icu::UnicodeString * a, icu::UnicodeString * b) { return a->compare(*b) < 0; });
+		for(icu::UnicodeString * t : all)
+		{
+			long h = budgets ? fts_backend_xapian_term_header(t) : -1;
+			if((terms->size() < XAPIAN_MAXTERMS_PERDOC) && ((terms->size()==0) || (terms->back()->compare(*t)!=0)) && ((h<0) || (fts_xapian_field_terms[h]<1) || (fterms[h] < fts_xapian_field_terms[h])))
+			{
+				terms->push_back(t);
+				if(h>=0) fterms[h]++;
+			}
+			else delete(t);
+		}
+		nterms = terms->size();
+	}
+
+	// Attachments seen before (same content) get their terms from the cache, the others are tokenized apart and cached
+	void terms_attachments(long verbose, const char * title, XDict * dict, std::vector<XDoc *> & shards)
+	{
+		long hits = 0;
+		for(auto & p : parts)
+		{
+			std::string key = fts_backend_xapian_digest_key(arena+p.first,p.second);
+			XTermsCacheEntry e;
+			XDoc * s = new XDoc(uid,owner.c_str());
+			if(fts_xapian_attachcache.get(key,e))
+			{
+				s->terms_restore(e,dict);
+				hits++;
+			}
+			else
+			{
+				XDict d;
+				s->terms_scan(arena+p.first,p.second,&d);
+				s->terms_save(key,&d,&fts_xapian_attachcache,fts_xapian_settings.attachcache);
+				dict->merge(&d);
 			}
-			terms_push(h,t);
+			shards.push_back(s);
 		}
+		if(verbose>0) syslog(LOG_INFO,"%sAttachments : %ld parts, %ld from cache",title,(long)parts.size(),hits);
+
+		// The parts done are cut from the arena, the last one first
+		for(long i=parts.size()-1;i>=0;i--)
+		{
+			size_t o = parts[i].first, l = parts[i].second;
+			memmove(arena+o,arena+o+l,arena_len-o-l);
+			arena_len -= l;
+		}
+		parts.clear();
+	}
+
+	bool terms_create(long verbose, const char * title, XDict * dict)
+	{
+		stream_end();
+		if(words!=NULL)
+		{
+			dict->merge(words);
+			delete(words);
+			words=NULL;
+		}
+
+		// Same content as a message tokenized shortly before (copy, move, fileinto) : its terms are reused
+		std::string key;
+		if((fts_xapian_settings.termscache>0) && (arena_len>0))
+		{
+			key = fts_backend_xapian_digest_key(arena,arena_len);
+			XTermsCacheEntry e;
+			if(fts_xapian_termscache.get(key,e))
+			{
+				terms_restore(e,dict);
+				if(verbose>0) syslog(LOG_INFO,"%sTerms from cache : %s",title,getDocSummary().c_str());
+				arena_free();
+				return true;
+			}
+		}
+
+		XDict local;
+		std::vector<XDoc *> shards;
+		if((fts_xapian_settings.attachcache>0) && (parts.size()>0)) terms_attachments(verbose,title,&local,shards);
+
+		if(arena_len >= XAPIAN_LARGE_DOC) terms_parallel(verbose,title,&local);
+		else terms_scan(arena,arena_len,&local);
+		terms_merge(shards);
+
+		if(key.length()>0) terms_save(key,&local,&fts_xapian_termscache,fts_xapian_settings.termscache);
+		dict->merge(&local);
+
+		arena_free();
 		return true;
 	}
 
+	void terms_restore(XTermsCacheEntry & e, XDict * dict)
+	{
+		for(auto & s : e.terms)
+		{
+			terms->push_back(new icu::UnicodeString(icu::UnicodeString::fromUTF8(icu::StringPiece(s))));
+		}
+		for(auto & w : e.words)
+		{
+			dict->add(w.first,w.second);
+		}
+		grams->insert(e.grams.begin(),e.grams.end());
+		nterms = terms->size();
+		ndict = e.words.size();
+	}
+
+	void terms_save(const std::string & key, XDict * local, XTermsCache * cache, unsigned long capacity)
+	{
+		XTermsCacheEntry e;
+		e.key = key;
+		e.owner = owner;
+		std::string s;
+		for(icu::UnicodeString * t : *terms)
+		{
+			fts_backend_xapian_icutostring(t,s);
+			e.terms.push_back(s);
+		}
+		local->list(e.words);
+		e.grams.assign(grams->begin(),grams->end());
+		cache->put(e,capacity);
+	}
+
+	// Body parts flagged as attachments are remembered, to be looked up in the attachments cache
+	void part_start(bool attachment)
+	{
+		part_off = arena_len;
+		part_attach = attachment;
+		part_bytes = 0;
+	}
+
+	// Bytes of the chunk within the budgets of its field and attachment, cut on a UTF-8 boundary
+	size_t budget(long h, const char * d, size_t size)
+	{
+		size_t n = size;
+		if((fts_xapian_field_bytes[h]>0) && (fbytes[h] + (long)n > fts_xapian_field_bytes[h])) n = std::max(0L, fts_xapian_field_bytes[h] - fbytes[h]);
+		if(part_attach && (fts_xapian_settings.attachbytes>0) && (part_bytes + n > fts_xapian_settings.attachbytes)) n = (part_bytes < fts_xapian_settings.attachbytes) ? (fts_xapian_settings.attachbytes - part_bytes) : 0;
+		while((n>0) && (n<size) && ((((unsigned char)d[n]) & 0xC0) == 0x80)) n--;
+		fbytes[h] += n;
+		part_bytes += n;
+		return n;
+	}
+
+	void part_end()
+	{
+		if(part_attach && (arena_len > part_off)) parts.push_back(std::make_pair(part_off,arena_len-part_off));
+		part_attach = false;
+	}
+
+	// Stream mode : the chunk is tokenized up to its last separator, the rest waits for the next chunk
+	void stream_load(long h, const char *d, size_t size)
+	{
+		size = budget(h,d,size);
+		if(size<1) return;
+
+		if(h!=carry_h) stream_end();
+		carry_h=h;
+		carry.append(d,size);
+		nlines++;
+
+		size_t k = carry.find_last_of(" \t\r\n\",:;()?!");
+		if(k==std::string::npos)
+		{
+			if(carry.length()<XAPIAN_STREAM_CARRY) return;
+			// No separator at all : cut before the last UTF-8 sequence
+			k=carry.length()-1;
+			while((k>0) && ((((unsigned char)carry[k]) & 0xC0) == 0x80)) k--;
+			if(k==0) return;
+		}
+		stream_tokenize(h,carry.data(),k);
+		carry.erase(0,k+1);
+	}
+
+	void stream_end()
+	{
+		if(carry_h>=0 && carry.length()>0) stream_tokenize(carry_h,carry.data(),carry.length());
+		carry.clear();
+		carry_h=-1;
+	}
+
+	void stream_tokenize(long h, const char *d, size_t size)
+	{
+		if(terms->size()>=XAPIAN_MAXTERMS_PERDOC) return;
+		if(words==NULL) words = new XDict();
+
+		icu::StringPiece sp(d,size);
+		terms_split(h,new icu::UnicodeString(icu::UnicodeString::fromUTF8(sp)),words);
+	}
+
+	void terms_split(long h, icu::UnicodeString *t, XDict * dict)
+	{
+		long k;
+
+		fts_backend_xapian_clean(t);
+
+		k = t->lastIndexOf(CHAR_SPACE);
+		while(k>0)
+		{
+			terms_push(h,new icu::UnicodeString(*t,k+1),dict);
+			t->truncate(k);
+			fts_backend_xapian_trim(t);
+			k = t->lastIndexOf(CHAR_SPACE);
+		}
+		terms_push(h,t,dict);
+	}
+
 	bool doc_create(long verbose, const char * title)
 	{
 		if(verbose>0) syslog(LOG_INFO,"%s adding %ld terms",title,nterms);
@@ -772,29 +2479,153 @@ class XDoc
 	} 
 };
 
+static void fts_backend_xapian_shard(XSlice * s)
+{
+	if(s->h<0) s->shard->terms_scan(s->a,s->len,s->dict);
+	else s->shard->terms_piece(s->h,s->a,s->len,s->dict);
+}
+
 static void fts_backend_xapian_worker(void *p);
 
+// Process-wide pool of writers : shared by all the backends and kept from a mailbox to the next
+class XDocsPool
+{
+	public:
+		std::mutex m;
+		std::vector<struct xapian_fts_backend *> backends; // with docs to process
+		std::vector<XDocsWriter *> writers;
+		unsigned long next; // round robin among the backends
+		long large; // writers busy on a large email
+		std::condition_variable cv; // idle writers wait for a ready doc
+		long signals; // counted, so that a signal between a pick and the wait is not missed
+		std::vector<XSlice *> slices; // slices of large emails waiting for a writer
+
+	XDocsPool()
+	{
+		next=0;
+		large=0;
+		signals=0;
+	}
+};
+
+static XDocsPool fts_xapian_pool;
+
+// Tokenizes a slice waiting in the pool, if any : the large emails use the writers, no extra thread
+static bool fts_backend_xapian_pool_slice()
+{
+	XSlice * s = NULL;
+	{
+		std::lock_guard<std::mutex> lck(fts_xapian_pool.m);
+		if(fts_xapian_pool.slices.size()<1) return false;
+		s = fts_xapian_pool.slices.front();
+		fts_xapian_pool.slices.erase(fts_xapian_pool.slices.begin());
+	}
+	fts_backend_xapian_shard(s);
+	{
+		std::lock_guard<std::mutex> lck(fts_xapian_pool.m);
+		s->done=true;
+		fts_xapian_pool.signals++;
+	}
+	fts_xapian_pool.cv.notify_all();
+	return true;
+}
+
+// The slices of a large email are offered to the idle writers : the caller tokenizes the first one,
+// then the ones not taken yet, and waits for the others
+static void fts_backend_xapian_pool_run(std::vector<XSlice *> & slices)
+{
+	if(slices.size()<1) return;
+	if(slices.size()>1)
+	{
+		{
+			std::lock_guard<std::mutex> lck(fts_xapian_pool.m);
+			fts_xapian_pool.slices.insert(fts_xapian_pool.slices.end(),slices.begin()+1,slices.end());
+			fts_xapian_pool.signals++;
+		}
+		fts_xapian_pool.cv.notify_all();
+	}
+	fts_backend_xapian_shard(slices[0]);
+	slices[0]->done=true;
+	while(fts_backend_xapian_pool_slice());
+
+	std::unique_lock<std::mutex> lck(fts_xapian_pool.m);
+	fts_xapian_pool.cv.wait(lck,[&]{ for(XSlice * s : slices) { if(!(s->done)) return false; } return true; });
+}
+
+// Wakes the idle writers : a doc is ready, a large one is done, or the writers are stopping
+static void fts_backend_xapian_pool_signal()
+{
+	{
+		std::lock_guard<std::mutex> lck(fts_xapian_pool.m);
+		fts_xapian_pool.signals++;
+	}
+	fts_xapian_pool.cv.notify_all();
+}
+
+// Takes the next ready doc of the attached backends, the backend is then marked as being served
+// Oldest ready doc first, but large emails go through a narrow lane so that they do not hold all the writers
+static XDoc * fts_backend_xapian_pool_pick(struct xapian_fts_backend ** b, bool * large, long * signals, long verbose, const char * title)
+{
+	XDoc * doc = NULL;
+	std::lock_guard<std::mutex> lck(fts_xapian_pool.m);
+	*signals = fts_xapian_pool.signals;
+
+	long lane = std::max(1L, (long)(fts_xapian_pool.writers.size() / XAPIAN_LARGE_LANE));
+	unsigned long n = fts_xapian_pool.backends.size();
+	for(unsigned long i=0;(i<n) && (doc==NULL);i++)
+	{
+		struct xapian_fts_backend * backend = fts_xapian_pool.backends[(fts_xapian_pool.next+i) % n];
+		fts_backend_xapian_get_lock(backend, verbose, title);
+		long k = backend->docs.size() - 1;
+		while((!backend->err) && (k>=0) && (backend->docs[k]->status==1))
+		{
+			if((backend->docs[k]->size() < XAPIAN_LARGE_DOC) || (fts_xapian_pool.large < lane))
+			{
+				doc = backend->docs[k];
+				backend->docs.erase(backend->docs.begin()+k);
+				backend->writers++;
+				*b = backend;
+				*large = (doc->size() >= XAPIAN_LARGE_DOC);
+				if(*large) fts_xapian_pool.large++;
+				fts_xapian_pool.next = (fts_xapian_pool.next+i+1) % n;
+				break;
+			}
+			k--;
+		}
+		fts_backend_xapian_release_lock(backend, verbose, title);
+	}
+	return doc;
+}
+
 class XDocsWriter
 {
 	private:
 		XDoc * doc;
+		XDict * dict;
 		long verbose, lowmemory;
+		long num;
+		long dt, totaldocs;
 		std::thread *t;
 		char title[1000];
-		struct xapian_fts_backend *backend;
+		struct xapian_fts_backend *backend; // currently served
+		bool large; // the doc served is in the large lane
 	public:
 		bool started,toclose,terminated;
 		bool err;
 		char err_s[10000];
 		
-	XDocsWriter(struct xapian_fts_backend *b, long n)
+	XDocsWriter(long n)
 	{
-		backend=b;
+		backend=NULL;
+		large=false;
+		num=n;
+		dt=0; totaldocs=0;
 
-		sprintf(title,"DW #%ld (%s,%s) - ",n,backend->boxname,backend->xap_db);
+		sprintf(title,"DW #%ld - ",num);
 
 		t=NULL;
 		doc=NULL;
+		dict=new XDict();
 		toclose=false;
 		terminated=false;
 		started=false;
@@ -812,6 +2643,12 @@ class XDocsWriter
 			  
 		try
 		{
+			if(backend->bulk)
+			{
+				if(verbose>0) syslog(LOG_INFO,"%sOpening bulk DB (RW) %s",title,backend->bulk_db);
+				backend->dbw = new Xapian::WritableDatabase(backend->bulk_db,Xapian::DB_CREATE_OR_OPEN | Xapian::DB_BACKEND_GLASS | Xapian::DB_NO_SYNC);
+				return true;
+			}
 			if(verbose>0) syslog(LOG_INFO,"%sOpening DB (RW)",title);
 			backend->dbw = new Xapian::WritableDatabase(backend->xap_db,Xapian::DB_CREATE_OR_OPEN | Xapian::DB_BACKEND_GLASS);
 			return true;
@@ -829,7 +2666,11 @@ class XDocsWriter
 
 	void close()
 	{
-		toclose=true;
+		{
+			std::lock_guard<std::mutex> lck(fts_xapian_pool.m);
+			toclose=true;
+		}
+		fts_backend_xapian_pool_signal();
 		if(t!=NULL)
 		{
 			t->join();
@@ -842,13 +2683,13 @@ class XDocsWriter
 	~XDocsWriter()
 	{
 		close();
+		delete(dict);
 	}
 
 	std::string getSummary()
 	{
 		std::string s(title);
-		s.append(" queued_docs="+std::to_string(backend->docs.size()));
-		s.append(" dict_size="+std::to_string(backend->dict_nb));
+		s.append(" dict_size="+std::to_string(dict->size()));
 		s.append(" terminated="+std::to_string(terminated));
 		return s;
 	}
@@ -884,37 +2725,51 @@ class XDocsWriter
 	{
 		// Memory check
 		long m = fts_backend_xapian_get_free_memory(verbose);
-		if(verbose>1) syslog(LOG_WARNING,"%sMemory : Free = %ld MB vs %ld limit | Pendings in cache = %ld / %ld | Dict size = %ld / %ld",title,(long)(m / 1024.0f),lowmemory,backend->pending,XAPIAN_WRITING_CACHE,backend->dict_nb,XAPIAN_DICT_MAX);
-		// First clean dictionnary
-		if((backend->dict_nb > XAPIAN_DICT_MAX) || ((m>0) && (m<(lowmemory*1024))))
+		long cache = backend->bulk ? (XAPIAN_WRITING_CACHE * XAPIAN_BULK_FACTOR) : XAPIAN_WRITING_CACHE;
+		if(verbose>1) syslog(LOG_WARNING,"%sMemory : Free = %ld MB vs %ld limit | Pendings in cache = %ld / %ld",title,(long)(m / 1024.0f),lowmemory,backend->pending,cache);
+		// First clean dictionnary : the words of the mailbox are flushed at once (unless left to the main thread)
+		if((!fts_backend_xapian_dict_deferred()) && ((backend->dict->size() > XAPIAN_DICT_MAX) || ((m>0) && (m<(lowmemory*1024)))))
 		{
-			if(!fts_backend_xapian_sqlite3_dict_flush(backend,verbose,err_s)) err=true;
+			fts_backend_xapian_get_lock(backend, verbose, title);
+
+			// Repeat test because the dict may have been flushed in another thread
+			if((backend->dict->size() > XAPIAN_DICT_MAX) || ((m>0) && (m<(lowmemory*1024))))
+			{
+				backend->dict->merge(dict);
+				if(!fts_backend_xapian_sqlite3_dict_flush(backend,verbose,err_s)) err=true;
+			}
+			fts_backend_xapian_release_lock(backend, verbose, title);
 			m = fts_backend_xapian_get_free_memory(verbose);
 		}
 
-		if((backend->dbw!=NULL) && ((backend->pending > XAPIAN_WRITING_CACHE) || ((m>0) && (m<(lowmemory*1024))))) // too little memory or too many pendings
+		if((backend->dbw!=NULL) && ((backend->pending > cache) || ((m>0) && (m<(lowmemory*1024))))) // too little memory or too many pendings
 		{
 			fts_backend_xapian_get_lock(backend, verbose, title);
 
 			// Repeat test because the close may have happen in another thread
 			m = fts_backend_xapian_get_free_memory(verbose);
-			if((backend->dbw!=NULL) && ((backend->pending > XAPIAN_WRITING_CACHE) || ((m>0) && (m<(lowmemory*1024)))))
+			if((backend->dbw!=NULL) && ((backend->pending > cache) || ((m>0) && (m<(lowmemory*1024)))))
 			{
 				try
 				{
-					if(backend->pending > XAPIAN_WRITING_CACHE) 
+					if(backend->pending > cache) 
 					{
-						syslog(LOG_WARNING,"%sCommitting %ld docs due to cached docs exceeded (%ld vs %ld limit)",title,backend->pending,backend->pending,XAPIAN_WRITING_CACHE);
+						syslog(LOG_WARNING,"%sCommitting %ld docs due to cached docs exceeded (%ld vs %ld limit)",title,backend->pending,backend->pending,cache);
 					}
 					else 
 					{
 						syslog(LOG_WARNING,"%sCommitting %ld docs due to low free memory (%ld MB vs %ld MB)",title,backend->pending,(long)(m/1024.0f),lowmemory);
 					}
+					if(!backend->bulk) backend->bloom->save(backend->bloom_db,false);
 					backend->dbw->close();
 					delete(backend->dbw);
 					if(verbose>0) syslog(LOG_INFO,"%sClosed Xapian DB %s",title,backend->xap_db);
 					backend->dbw = NULL;
 					backend->pending = 0;
+					for(auto u = backend->uncommitted->begin(); u != backend->uncommitted->end(); )
+					{
+						if(u->second) u = backend->uncommitted->erase(u); else ++u;
+					}
 				}
 				catch(Xapian::Error e)
 				{
@@ -934,122 +2789,221 @@ class XDocsWriter
 		return m;
 	}
 		
-	void worker()
+	// Done with the doc : its words go to the dict of its mailbox before serving another one
+	void release()
 	{
-		long start_time = fts_backend_xapian_current_time();
-		XDoc *doc = NULL;
-		long totaldocs=0;
-		long sl=0, dt=0;
-
-		while((!err) && ((!toclose) || (doc!=NULL)))
+		if(large)
 		{
-			if(doc==NULL)
+			large=false;
 			{
-				if(verbose>0) syslog(LOG_INFO,"%sSearching doc",title);
+				std::lock_guard<std::mutex> lck(fts_xapian_pool.m);
+				fts_xapian_pool.large--;
+			}
+			fts_backend_xapian_pool_signal(); // the large lane has room again
+		}
+
+		fts_backend_xapian_get_lock(backend, verbose, title);
+		if(err)
+		{
+			backend->err=true;
+			strcpy(backend->err_s,err_s);
+			dict->clear();
+		}
+		else backend->dict->merge(dict);
+		backend->writers--;
+		fts_backend_xapian_release_lock(backend, verbose, title);
+
+		backend=NULL;
+		err=false;
+		sprintf(title,"DW #%ld - ",num);
+	}
 
+	// Moves the current doc one stage further : stems, Xapian doc, then write
+	void step()
+	{
+		if(doc->status==1)	
+		{
+			if(doc->spooled())
+			{
+				bool ok = doc->unspill(backend->spool_fd);
 				fts_backend_xapian_get_lock(backend, verbose, title);
-				if((backend->docs.size()>0) && (backend->docs.back()->status==1)) 
+				backend->spool_docs--;
+				fts_backend_xapian_release_lock(backend, verbose, title);
+				if(!ok)
 				{
-					doc = backend->docs.back();
-					backend->docs.pop_back();
-					dt=fts_backend_xapian_current_time();
+					sprintf(err_s,"%sCan't read %s from the spool : %s",title,doc->getDocSummary().c_str(),strerror(errno));
+					syslog(LOG_ERR,"%s",err_s);
+					err=true;
+					return;
 				}
-				fts_backend_xapian_release_lock(backend, verbose, title);
 			}
-
-			if(doc==NULL)
+			checkMemory();
+			if(verbose>0)	syslog(LOG_INFO,"%sPopulating stems : %s",title,doc->getDocSummary().c_str());
+			if(doc->terms_create(verbose,title,dict)) 
+			{ 
+				doc->status=2; doc->status_n=0;
+				if(verbose>0) syslog(LOG_INFO,"%sPopulating stems : %ld done in %ld msec",title,doc->nterms,fts_backend_xapian_current_time()-dt);
+				dt=fts_backend_xapian_current_time();
+			}
+			else 
 			{
-				sl++;
-				if((sl>50) && (verbose>0)) 
-				{ 
-					syslog(LOG_INFO,"%sNoop",title);
-					sl=0;
+				doc->status_n++;
+				if(verbose>0) syslog(LOG_INFO,"%sPopulating stems : Error - %s",title,doc->getDocSummary().c_str());
+				if(doc->status_n > XAPIAN_MAX_ERRORS) 
+				{
+					delete(doc);
+					doc=NULL;
 				}
-				std::this_thread::sleep_for(XAPIAN_SLEEP);
 			}
-			else if(doc->status==1)	
+		}
+		else if(doc->status==2)
+		{
+			checkMemory();
+			if(verbose>0) syslog(LOG_INFO,"%sCreating Xapian doc : %s",title,doc->getDocSummary().c_str());
+			if(doc->doc_create(verbose,title))
 			{
-				checkMemory();
-				if(verbose>0)	syslog(LOG_INFO,"%sPopulating stems : %s",title,doc->getDocSummary().c_str());
-				if(doc->terms_create(verbose,title)) 
-				{ 
-					doc->status=2; doc->status_n=0;
-					if(verbose>0) syslog(LOG_INFO,"%sPopulating stems : %ld done in %ld msec",title,doc->nterms,fts_backend_xapian_current_time()-dt);
-					dt=fts_backend_xapian_current_time();
-				}
-				else 
+				doc->status=3;
+				doc->status_n=0;
+				if(verbose>0) syslog(LOG_INFO,"%sCreating Xapian doc : Done in %ld msec",title,fts_backend_xapian_current_time()-dt);
+				dt=fts_backend_xapian_current_time();
+			}
+			else
+			{
+				doc->status_n++;
+				if(verbose>0) syslog(LOG_INFO,"%sCreate document : Error",title);
+				if(doc->status_n > XAPIAN_MAX_ERRORS)
 				{
-					doc->status_n++;
-					if(verbose>0) syslog(LOG_INFO,"%sPopulating stems : Error - %s",title,doc->getDocSummary().c_str());
-					if(doc->status_n > XAPIAN_MAX_ERRORS) 
-					{
-						delete(doc);
-						doc=NULL;
-					}
+					delete(doc);
+					doc=NULL;
 				}
 			}
-			else if(doc->status==2)
+		}
+		else
+		{
+			if(verbose>0) syslog(LOG_INFO,"%sPushing : %s",title,doc->getDocSummary().c_str());
+			if(doc->nterms > 0)
 			{
 				checkMemory();
-				if(verbose>0) syslog(LOG_INFO,"%sCreating Xapian doc : %s",title,doc->getDocSummary().c_str());
-				if(doc->doc_create(verbose,title))
-				{
-					doc->status=3;
-					doc->status_n=0;
-					if(verbose>0) syslog(LOG_INFO,"%sCreating Xapian doc : Done in %ld msec",title,fts_backend_xapian_current_time()-dt);
-					dt=fts_backend_xapian_current_time();
-				}
-				else
+				fts_backend_xapian_get_lock(backend, verbose, title);
+				if(checkDB() && (!err))
 				{
-					doc->status_n++;
-					if(verbose>0) syslog(LOG_INFO,"%sCreate document : Error",title);
-					if(doc->status_n > XAPIAN_MAX_ERRORS)
+					try
 					{
+						backend->dbw->replace_document(doc->uterm,*(doc->xdoc));
+						backend->dict->merge(dict);
+						backend->bloom->add(*(doc->grams));
+						if(!backend->bulk) (*(backend->uncommitted))[doc->uid]=true;
+						backend->pending++;
+						backend->total_docs++;
 						delete(doc);
 						doc=NULL;
+						if(verbose>0) syslog(LOG_INFO,"%sPushing done in %ld msec",title,fts_backend_xapian_current_time()-dt);
+						totaldocs++;
 					}
-				}
-			}
-			else
-			{
-				if(verbose>0) syslog(LOG_INFO,"%sPushing : %s",title,doc->getDocSummary().c_str());
-				if(doc->nterms > 0)
-				{
-					checkMemory();
-					fts_backend_xapian_get_lock(backend, verbose, title);
-					if(checkDB() && (!err))
+					catch(Xapian::Error e)
 					{
-						try
-						{
-							backend->dbw->replace_document(doc->uterm,*(doc->xdoc));
-							backend->pending++;
-							backend->total_docs++;
-							delete(doc);
-							doc=NULL;
-							if(verbose>0) syslog(LOG_INFO,"%sPushing done in %ld msec",title,fts_backend_xapian_current_time()-dt);
-							totaldocs++;
-						}
-						catch(Xapian::Error e)
-						{
-							sprintf(err_s,"%sCan't write doc1 %s : %s - %s",title,doc->getDocSummary().c_str(),e.get_type(),e.get_msg().c_str());
-							syslog(LOG_ERR,"%s",err_s);
-							err=true;
-						}
-						catch(std::exception const & e)
-						{
-							sprintf(err_s,"%sCan't write doc2 %s : %s",title,doc->getDocSummary().c_str(),e.what());
-							syslog(LOG_ERR,"%s",err_s);
-							err=true;
-						}
+						sprintf(err_s,"%sCan't write doc1 %s : %s - %s",title,doc->getDocSummary().c_str(),e.get_type(),e.get_msg().c_str());
+						syslog(LOG_ERR,"%s",err_s);
+						err=true;
+					}
+					catch(std::exception const & e)
+					{
+						sprintf(err_s,"%sCan't write doc2 %s : %s",title,doc->getDocSummary().c_str(),e.what());
+						syslog(LOG_ERR,"%s",err_s);
+						err=true;
 					}
-					fts_backend_xapian_release_lock(backend, verbose, title);	
 				}
-				else 
+				fts_backend_xapian_release_lock(backend, verbose, title);	
+			}
+			else 
+			{
+				delete(doc);
+				doc=NULL;
+			}
+		}
+	}
+
+	// Small batches : the ready docs of the backend are written in the calling thread, without the pool
+	long flush_inline(struct xapian_fts_backend * b)
+	{
+		long n=0;
+		while(!(b->err))
+		{
+			fts_backend_xapian_get_lock(b, verbose, title);
+			if((b->docs.size()>0) && (b->docs.back()->status==1))
+			{
+				doc = b->docs.back();
+				b->docs.pop_back();
+				b->writers++;
+			}
+			fts_backend_xapian_release_lock(b, verbose, title);
+			if(doc==NULL) break;
+
+			backend=b;
+			snprintf(title,sizeof(title),"Inline (%s,%s) - ",backend->boxname,backend->xap_db);
+			dt=fts_backend_xapian_current_time();
+			long tries=0;
+			while((doc!=NULL) && (!err) && (tries < XAPIAN_MAX_ERRORS))
+			{
+				step();
+				tries++;
+			}
+			if((doc!=NULL) && (!err))
+			{
+				sprintf(err_s,"%sCan't write %s",title,doc->getDocSummary().c_str());
+				syslog(LOG_ERR,"%s",err_s);
+				err=true;
+			}
+			if(doc!=NULL)
+			{
+				delete(doc);
+				doc=NULL;
+			}
+			release();
+			n++;
+		}
+		return n;
+	}
+
+	void worker()
+	{
+		long start_time = fts_backend_xapian_current_time();
+		doc = NULL;
+		totaldocs=0;
+		long signals=0;
+
+		while((!toclose) || (doc!=NULL))
+		{
+			if((doc==NULL) && fts_backend_xapian_pool_slice()) continue;
+
+			if(doc==NULL)
+			{
+				if(verbose>1) syslog(LOG_INFO,"%sSearching doc",title);
+
+				doc = fts_backend_xapian_pool_pick(&backend, &large, &signals, verbose, title);
+				if(doc!=NULL)
 				{
-					delete(doc);
-					doc=NULL;
+					snprintf(title,sizeof(title),"DW #%ld (%s,%s) - ",num,backend->boxname,backend->xap_db);
+					if(large && (verbose>0)) syslog(LOG_INFO,"%sLarge doc lane : %s (%ld bytes)",title,doc->getDocSummary().c_str(),(long)doc->size());
+					dt=fts_backend_xapian_current_time();
 				}
 			}
+
+			if(doc==NULL)
+			{
+				// Idle until signaled : no polling of the pool and of the backends
+				std::unique_lock<std::mutex> lck(fts_xapian_pool.m);
+				fts_xapian_pool.cv.wait(lck,[&]{ return toclose || (fts_xapian_pool.signals != signals) || (fts_xapian_pool.slices.size()>0); });
+			}
+			else step();
+
+			// An error stops the indexing of the mailbox only, the writer goes on with the others
+			if(err && (doc!=NULL))
+			{
+				delete(doc);
+				doc=NULL;
+			}
+			if((doc==NULL) && (backend!=NULL)) release();
 		}
 
 		if(doc!=NULL) 
@@ -1057,8 +3011,10 @@ class XDocsWriter
 			delete(doc);
 			doc=NULL;
 		}
+		if(backend!=NULL) release();
+
 		terminated=true;
-		 if((verbose>0) && (!err))
+		 if(verbose>0)
 		{
 			syslog(LOG_INFO,"%sIndexed %ld docs within %ld msec",title,totaldocs,fts_backend_xapian_current_time() - start_time);
 		}
@@ -1070,6 +3026,65 @@ static void fts_backend_xapian_worker(void *p)
 	XDocsWriter *xw = (XDocsWriter *)p;
 	xw->worker();
 }
+
+// Makes the docs of the backend visible to the pool, which grows up to the global limit
+static void fts_backend_xapian_pool_attach(struct xapian_fts_backend *backend, const char * from)
+{
+	std::lock_guard<std::mutex> lck(fts_xapian_pool.m);
+
+	if(!(backend->attached))
+	{
+		fts_xapian_pool.backends.push_back(backend);
+		backend->attached=true;
+	}
+
+	// Relaunch post error
+	for(auto & xwr : fts_xapian_pool.writers)
+	{
+		if(!(xwr->started)) xwr->launch(from);
+	}
+
+	if(fts_xapian_pool.writers.size() < backend->max_threads)
+	{
+		XDocsWriter * x = new XDocsWriter(fts_xapian_pool.writers.size()+1);
+		x->launch(from);
+		fts_xapian_pool.writers.push_back(x);
+	}
+
+	fts_xapian_pool.signals++;
+	fts_xapian_pool.cv.notify_all();
+}
+
+static void fts_backend_xapian_pool_detach(struct xapian_fts_backend *backend)
+{
+	std::lock_guard<std::mutex> lck(fts_xapian_pool.m);
+
+	for(unsigned long i=0;i<fts_xapian_pool.backends.size();i++)
+	{
+		if(fts_xapian_pool.backends[i] == backend)
+		{
+			fts_xapian_pool.backends.erase(fts_xapian_pool.backends.begin()+i);
+			break;
+		}
+	}
+	fts_xapian_pool.next=0;
+	backend->attached=false;
+}
+
+// Stops the writers, at the unloading of the plugin
+void fts_backend_xapian_pool_stop(void)
+{
+	std::vector<XDocsWriter *> writers;
+	{
+		std::lock_guard<std::mutex> lck(fts_xapian_pool.m);
+		writers.swap(fts_xapian_pool.writers);
+	}
+	for(auto & xwr : writers)
+	{
+		xwr->close();
+		delete(xwr);
+	}
+}
 	
 static bool fts_backend_xapian_open_readonly(struct xapian_fts_backend *backend, Xapian::Database ** dbr)
 {
@@ -1105,77 +3120,376 @@ static void fts_backend_xapian_oldbox(struct xapian_fts_backend *backend)
 		double r=0;
 		if(dt>0)
 		{
-			r=backend->total_docs*1000.0;
-			r=r/dt;
+			r=backend->total_docs*1000.0;
+			r=r/dt;
+		}
+		/* End Performance calculator*/
+
+		if(fts_xapian_settings.verbose>0) i_info("FTS Xapian: Done indexing '%s' (%s) (%ld msgs in %ld msec, rate: %.1f)",backend->old_boxname, backend->xap_db,backend->total_docs,dt,r);
+
+		i_free(backend->old_guid); backend->old_guid = NULL;
+		i_free(backend->old_boxname); backend->old_boxname = NULL;
+	}
+
+	if(fts_xapian_settings.verbose>1) i_info("FTS Xapian: fts_backend_xapian_oldbox - done");
+}
+
+static void fts_backend_xapian_close_db(Xapian::WritableDatabase * dbw,const char * dbpath,const char * boxname, long verbose)
+{
+	long t;
+
+	if(verbose>0)
+	{
+		t = fts_backend_xapian_current_time();
+		syslog(LOG_INFO,"FTS Xapian : Closing DB (%s,%s)",boxname,dbpath);
+	}
+	try
+	{
+		dbw->close();
+		delete(dbw);
+	}
+	catch(Xapian::Error e)
+	{
+		syslog(LOG_ERR, "FTS Xapian: Can't close Xapian DB (%s) %s : %s - %s %s",boxname,dbpath,e.get_type(),e.get_msg().c_str(),e.get_error_string());
+	}
+	catch(std::exception const& e)
+	{
+		syslog(LOG_ERR, "FTS Xapian : Closing db (%s) error %s",dbpath,e.what());
+	}
+
+	if(verbose>0) 
+	{
+		t = fts_backend_xapian_current_time()-t;
+		syslog(LOG_INFO,"FTS Xapian : DB (%s,%s) closed in %ld ms",boxname,dbpath,t);
+	}
+}
+
+// Overflow of the queue : the doc being filled (not yet visible to the writers) is moved to the spool file
+static bool fts_backend_xapian_spool(struct xapian_fts_backend *backend)
+{
+	if(backend->spool_fd<0)
+	{
+		std::string path(backend->xap_db); path.append(suffixSpool);
+		backend->spool_fd = open(path.c_str(),O_RDWR | O_CREAT | O_TRUNC,0600);
+		backend->spool_size = 0;
+		if(backend->spool_fd<0)
+		{
+			i_warning("FTS Xapian: Can not create spool %s : %s",path.c_str(),strerror(errno));
+			return false;
+		}
+		if(fts_xapian_settings.verbose>0) i_info("FTS Xapian: Queue of '%s' overflowing to %s",backend->boxname,path.c_str());
+	}
+
+	fts_backend_xapian_get_lock(backend, fts_xapian_settings.verbose, "spool");
+	XDoc * doc = (backend->docs.size()>0) ? backend->docs.front() : NULL;
+	// All the spooled docs read back : the file starts over (only this thread writes to it)
+	if((backend->spool_docs<1) && (backend->spool_size>0))
+	{
+		if(ftruncate(backend->spool_fd,0)==0) backend->spool_size = 0;
+		if(fts_xapian_settings.verbose>0) i_info("FTS Xapian: Spool of '%s' drained, truncated",backend->boxname);
+	}
+	fts_backend_xapian_release_lock(backend, fts_xapian_settings.verbose, "spool");
+
+	if(backend->spool_size >= XAPIAN_SPOOL_MAX) return false;
+	if((doc==NULL) || (doc->status>0)) return true;
+	if(!(doc->spill(backend->spool_fd,backend->spool_size)))
+	{
+		i_warning("FTS Xapian: Can not spool %s : %s",doc->getDocSummary().c_str(),strerror(errno));
+		return false;
+	}
+	fts_backend_xapian_get_lock(backend, fts_xapian_settings.verbose, "spool");
+	backend->spool_size += doc->spool_len;
+	backend->spool_docs++;
+	fts_backend_xapian_release_lock(backend, fts_xapian_settings.verbose, "spool");
+	return true;
+}
+
+static bool fts_backend_xapian_attachcache_disk()
+{
+	return (fts_xapian_settings.attachcache>0) && (fts_xapian_settings.attachcache_mode!=NULL) && (strcmp(fts_xapian_settings.attachcache_mode,XAPIAN_ATTACHCACHE_DISK)==0);
+}
+
+static void fts_backend_xapian_attachcache_load(struct xapian_fts_backend *backend)
+{
+	if((!fts_backend_xapian_attachcache_disk()) || (backend->path == NULL)) return;
+
+	std::string path(backend->path); path.append("/"); path.append(fileAttachCache);
+	if(fts_xapian_attachcache.load(path.c_str(),backend->path,fts_xapian_settings.attachcache))
+	{
+		if(fts_xapian_settings.verbose>0) i_info("FTS Xapian: Attachments cache loaded from %s",path.c_str());
+	}
+}
+
+static void fts_backend_xapian_attachcache_save(struct xapian_fts_backend *backend)
+{
+	if((!fts_backend_xapian_attachcache_disk()) || (backend->path == NULL)) return;
+
+	std::string path(backend->path); path.append("/"); path.append(fileAttachCache);
+	if(fts_xapian_attachcache.save(path.c_str(),backend->path))
+	{
+		if(fts_xapian_settings.verbose>0) i_info("FTS Xapian: Attachments cache saved to %s (hits=%ld misses=%ld)",path.c_str(),fts_xapian_attachcache.hits,fts_xapian_attachcache.misses);
+	}
+}
+
+static void fts_backend_xapian_spool_close(struct xapian_fts_backend *backend)
+{
+	if(backend->spool_fd<0) return;
+
+	::close(backend->spool_fd);
+	backend->spool_fd=-1;
+	backend->spool_size=0;
+	backend->spool_docs=0;
+
+	std::error_code errorCode;
+	std::string path(backend->xap_db); path.append(suffixSpool);
+	std::filesystem::remove(path,errorCode);
+}
+
+static bool fts_backend_xapian_fsync(const char * path)
+{
+	int fd = open(path,O_RDONLY);
+	if(fd<0) return false;
+	bool ok = (fsync(fd)==0);
+	::close(fd);
+	return ok;
+}
+
+static bool fts_backend_xapian_fsync_dir(const char * path)
+{
+	bool ok = true;
+	std::error_code errorCode;
+	for(auto& f : std::filesystem::directory_iterator(path,errorCode))
+	{
+		if(f.is_regular_file() && (!fts_backend_xapian_fsync(f.path().c_str()))) ok=false;
+	}
+	if(errorCode) ok=false;
+	if(!fts_backend_xapian_fsync(path)) ok=false;
+	return ok;
+}
+
+// Start of the first indexing of a large mailbox : the docs go to a separate bulk DB, swapped in at closure.
+// The lock is held until the swap, and a bulk DB left behind by a crash is resumed rather than rebuilt.
+// Returns false if another process is bulk indexing the mailbox.
+static bool fts_backend_xapian_bulk_start(struct xapian_fts_backend *backend)
+{
+	struct stat sb;
+	std::string t(backend->bulk_db); t.append("/termlist.glass");
+	bool resume = (stat(t.c_str(), &sb)==0) && S_ISREG(sb.st_mode);
+	if((!resume) && ((fts_xapian_settings.bulk<1) || (backend->messages < fts_xapian_settings.bulk))) return true;
+
+	std::string l(backend->bulk_db); l.append(suffixLock);
+	int fd = open(l.c_str(), O_CREAT | O_RDWR | O_CLOEXEC, 0600);
+	if(fd<0)
+	{
+		i_warning("FTS Xapian: Can not open %s (%s) : no bulk mode for '%s'",l.c_str(),strerror(errno),backend->boxname);
+		return true;
+	}
+	if(flock(fd, LOCK_EX | LOCK_NB)!=0)
+	{
+		close(fd);
+		i_info("FTS Xapian: '%s' (%s) is being bulk indexed by another process",backend->boxname,backend->guid);
+		return false;
+	}
+
+	// Only for an empty DB : a bulk DB next to a populated one is a leftover
+	long last = 0;
+	Xapian::Database * dbr;
+	if(fts_backend_xapian_open_readonly(backend, &dbr))
+	{
+		try
+		{
+			last = Xapian::sortable_unserialise(dbr->get_value_upper_bound(1));
+		}
+		catch(Xapian::Error e)
+		{
+			i_warning("FTS Xapian: Bulk start of '%s' : %s",backend->boxname,e.get_msg().c_str());
+		}
+		dbr->close();
+		delete(dbr);
+	}
+	if(last>0)
+	{
+		std::error_code errorCode;
+		if(resume) std::filesystem::remove_all(backend->bulk_db,errorCode);
+		close(fd);
+		return true;
+	}
+
+	if(resume)
+	{
+		backend->bulk_done = new std::unordered_set<long>();
+		try
+		{
+			Xapian::Database db(backend->bulk_db,Xapian::DB_BACKEND_GLASS);
+			for(Xapian::ValueIterator v = db.valuestream_begin(1); v != db.valuestream_end(1); ++v)
+			{
+				backend->bulk_done->insert((long)Xapian::sortable_unserialise(*v));
+			}
+			if(!fts_backend_xapian_bloom_fill(&db,backend->bloom,backend->bulk_db)) resume = false;
+			db.close();
+		}
+		catch(Xapian::Error e)
+		{
+			i_warning("FTS Xapian: Can not resume bulk DB %s : %s",backend->bulk_db,e.get_msg().c_str());
+			resume = false;
 		}
-		/* End Performance calculator*/
+		if(!resume)
+		{
+			std::error_code errorCode;
+			std::filesystem::remove_all(backend->bulk_db,errorCode);
+			backend->bulk_done->clear();
+			backend->bloom->clear();
+		}
+	}
+	if(resume) i_info("FTS Xapian: '%s' (%s) : resuming bulk indexing after %ld docs",backend->boxname,backend->guid,(long)backend->bulk_done->size());
+	else i_info("FTS Xapian: '%s' (%s) has %ld messages to index : using bulk mode",backend->boxname,backend->guid,backend->messages);
 
-		if(fts_xapian_settings.verbose>0) i_info("FTS Xapian: Done indexing '%s' (%s) (%ld msgs in %ld msec, rate: %.1f)",backend->old_boxname, backend->xap_db,backend->total_docs,dt,r);
+	backend->bulk_fd = fd;
+	backend->bulk = true;
+	return true;
+}
 
-		i_free(backend->old_guid); backend->old_guid = NULL;
-		i_free(backend->old_boxname); backend->old_boxname = NULL;
-	}
+// True if another indexer holds the bulk lock of the mailbox : its DB is about to be swapped, not to be recreated
+static bool fts_backend_xapian_bulk_locked(struct xapian_fts_backend *backend)
+{
+	std::string l(backend->bulk_db); l.append(suffixLock);
+	int fd = open(l.c_str(), O_RDONLY | O_CLOEXEC);
+	if(fd<0) return false;
+	bool locked = (flock(fd, LOCK_SH | LOCK_NB)!=0) && (errno == EWOULDBLOCK);
+	close(fd);
+	return locked;
+}
 
-	if(fts_xapian_settings.verbose>1) i_info("FTS Xapian: fts_backend_xapian_oldbox - done");
+static void fts_backend_xapian_bulk_release(struct xapian_fts_backend *backend)
+{
+	if(backend->bulk_done != NULL) delete(backend->bulk_done);
+	backend->bulk_done = NULL;
+	if(backend->bulk_fd >= 0) close(backend->bulk_fd); // releases the lock
+	backend->bulk_fd = -1;
 }
 
-static void fts_backend_xapian_close_db(Xapian::WritableDatabase * dbw,const char * dbpath,const char * boxname, long verbose)
+// End of bulk indexing : the bulk DB is compacted, synced on disk, and swapped in place of the regular DB
+static void fts_backend_xapian_bulk_swap(struct xapian_fts_backend *backend, bool err)
 {
-	long t;
+	std::error_code errorCode;
+	std::string bulk(backend->bulk_db);
+	std::string compact(backend->xap_db); compact.append(suffixCompact);
+	std::string old(backend->xap_db); old.append(suffixOld);
 
-	if(verbose>0)
+	struct stat sb;
+	std::string t = bulk + "/termlist.glass";
+	if(err || (!( (stat(t.c_str(), &sb)==0) && S_ISREG(sb.st_mode))))
 	{
-		t = fts_backend_xapian_current_time();
-		syslog(LOG_INFO,"FTS Xapian : Closing DB (%s,%s)",boxname,dbpath);
+		if(fts_xapian_settings.verbose>0) syslog(LOG_INFO,"FTS Xapian: Discarding bulk DB %s",backend->bulk_db);
+		std::filesystem::remove_all(bulk,errorCode);
+		return;
 	}
+
+	long dt = fts_backend_xapian_current_time();
+	if(fts_xapian_settings.verbose>0) syslog(LOG_INFO,"FTS Xapian: Compacting bulk DB %s",backend->bulk_db);
+
+	std::filesystem::remove_all(compact,errorCode);
+	std::string src = bulk;
 	try
 	{
-		dbw->close();
-		delete(dbw);
+		Xapian::Database db(bulk,Xapian::DB_BACKEND_GLASS);
+		db.compact(compact);
+		db.close();
+		src = compact;
 	}
 	catch(Xapian::Error e)
 	{
-		syslog(LOG_ERR, "FTS Xapian: Can't close Xapian DB (%s) %s : %s - %s %s",boxname,dbpath,e.get_type(),e.get_msg().c_str(),e.get_error_string());
+		syslog(LOG_WARNING,"FTS Xapian: Can not compact bulk DB %s (%s), using it as is",backend->bulk_db,e.get_msg().c_str());
+		std::filesystem::remove_all(compact,errorCode);
 	}
-	catch(std::exception const& e)
+
+	if(!fts_backend_xapian_fsync_dir(src.c_str()))
 	{
-		syslog(LOG_ERR, "FTS Xapian : Closing db (%s) error %s",dbpath,e.what());
+		syslog(LOG_ERR,"FTS Xapian: Can not sync %s on disk : bulk indexing of '%s' discarded",src.c_str(),backend->boxname);
+		std::filesystem::remove_all(compact,errorCode);
+		std::filesystem::remove_all(bulk,errorCode);
+		return;
 	}
 
-	if(verbose>0) 
+	// The bulk DB replaces an empty one : its filter is complete
+	backend->bloom->save(backend->bloom_db,true);
+
+	std::filesystem::remove_all(old,errorCode);
+	bool moved = false, exchanged = false;
+	bool exists = std::filesystem::exists(backend->xap_db,errorCode);
+#ifdef RENAME_EXCHANGE
+	// Both folders are exchanged at once : the mailbox always has a DB in place, the previous one is removed below
+	if(exists)
 	{
-		t = fts_backend_xapian_current_time()-t;
-		syslog(LOG_INFO,"FTS Xapian : DB (%s,%s) closed in %ld ms",boxname,dbpath,t);
+		if(renameat2(AT_FDCWD,src.c_str(),AT_FDCWD,backend->xap_db,RENAME_EXCHANGE)==0) exchanged = true;
+		else if((errno != EINVAL) && (errno != ENOSYS))
+		{
+			syslog(LOG_ERR,"FTS Xapian: Can not swap bulk DB %s : %s",src.c_str(),strerror(errno));
+			std::filesystem::remove_all(compact,errorCode);
+			return;
+		}
+	}
+#endif
+	// Otherwise two renames : the other processes do not recreate the DB meanwhile, as the bulk lock is held
+	if(exists && (!exchanged))
+	{
+		std::filesystem::rename(backend->xap_db,old,errorCode);
+		if(errorCode)
+		{
+			// The bulk DB is kept for the next attempt
+			syslog(LOG_ERR,"FTS Xapian: Can not move %s aside : %s",backend->xap_db,errorCode.message().c_str());
+			std::filesystem::remove_all(compact,errorCode);
+			return;
+		}
+		moved = true;
+	}
+	if(!exchanged)
+	{
+		std::filesystem::rename(src,backend->xap_db,errorCode);
+		if(errorCode)
+		{
+			syslog(LOG_ERR,"FTS Xapian: Can not swap bulk DB %s : %s",src.c_str(),errorCode.message().c_str());
+			if(moved)
+			{
+				std::error_code e;
+				std::filesystem::rename(old,backend->xap_db,e);
+				if(e) syslog(LOG_ERR,"FTS Xapian: Can not restore %s : %s",backend->xap_db,e.message().c_str());
+			}
+			std::filesystem::remove_all(compact,errorCode);
+			return;
+		}
 	}
+	fts_backend_xapian_fsync(backend->path);
+
+	std::filesystem::remove_all(old,errorCode);
+	std::filesystem::remove_all(compact,errorCode);
+	std::filesystem::remove_all(bulk,errorCode);
+
+	if(fts_xapian_settings.verbose>0) syslog(LOG_INFO,"FTS Xapian: Bulk DB of '%s' swapped in %ld msec",backend->boxname,fts_backend_xapian_current_time()-dt);
+}
+
+static void fts_backend_xapian_bulk_finish(struct xapian_fts_backend *backend, bool err)
+{
+	backend->bulk = false;
+	fts_backend_xapian_bulk_swap(backend,err);
+	fts_backend_xapian_bulk_release(backend);
 }
 
 static void fts_backend_xapian_close(struct xapian_fts_backend *backend, const char * purpose)
 {
 	char reason[10000];
 
-	bool err=false;
-	for(auto & xwr : backend->threads)
+	bool err=backend->err;
+	if(err) 
 	{
-		if(xwr->err)
-		{
-			err=true;
-			strcpy(reason,xwr->err_s);
-			break;
-		}
+		strcpy(reason,backend->err_s);
 	}
-	
-	if(!err) strcpy(reason,purpose);
+	else strcpy(reason,purpose);
 
-	if(fts_xapian_settings.verbose>0) i_info("FTS Xapian : Closing all DWs (%s)",reason);
+	if(fts_xapian_settings.verbose>0) syslog(LOG_INFO,"FTS Xapian : Closing the queue of '%s' (%s)",backend->boxname,reason);
 
 	if(err)
 	{
-		for(auto & xwr : backend->threads)
-		{
-			xwr->err=true;
-			xwr->toclose=true;
-		}
-		
 		fts_backend_xapian_get_lock(backend,fts_xapian_settings.verbose,reason);
 		while(backend->docs.size()>0)
 		{
@@ -1196,83 +3510,100 @@ static void fts_backend_xapian_close(struct xapian_fts_backend *backend, const c
 		fts_backend_xapian_get_lock(backend,fts_xapian_settings.verbose,reason);
 		if((backend->docs.size()>0) && (backend->docs.front()->status<1)) backend->docs.front()->status=1;
 		fts_backend_xapian_release_lock(backend,fts_xapian_settings.verbose,reason);
+		fts_backend_xapian_pool_signal();
+
+		if(!(backend->attached))
+		{
+			// Small batch : written in the calling thread, no thread and no wait
+			XDocsWriter w(0);
+			long k = w.flush_inline(backend);
+			if((k>0) && (fts_xapian_settings.verbose>0)) syslog(LOG_INFO,"FTS Xapian: %ld docs of '%s' written inline",k,backend->boxname);
+		}
 
 		long n=0;
-		while(backend->docs.size()>0)
+		while((backend->docs.size()>0) && (!(backend->err)))
 		{
 			n++;
 			if((n>50) and (fts_xapian_settings.verbose>0))
 			{
-				i_info("FTS Xapian: Waiting for all pending documents (%ld) to be processed (Sleep5) with %ld threads",backend->docs.size(),backend->threads.size());
+				syslog(LOG_INFO,"FTS Xapian: Waiting for all pending documents (%ld) to be processed (Sleep5)",backend->docs.size());
 				n=0;
 			}
 			std::this_thread::sleep_for(XAPIAN_SLEEP);
 		}
-
-		for(auto & xwr : backend->threads)
-		{
-			xwr->toclose=true;
-		}
 	}
 
-	XDocsWriter * xw;
+	// The pool stops serving the backend, the docs being processed are finished first
+	if(backend->attached) fts_backend_xapian_pool_detach(backend);
 	long n=0;
-	while(backend->threads.size()>0)
+	while(true)
 	{
-		xw = backend->threads.back();
-
-		if(!(xw->started))
+		fts_backend_xapian_get_lock(backend,fts_xapian_settings.verbose,reason);
+		long w = backend->writers;
+		fts_backend_xapian_release_lock(backend,fts_xapian_settings.verbose,reason);
+		if(w<1) break;
+		n++;
+		if((n>50) && (fts_xapian_settings.verbose>0)) 
 		{
-			if(fts_xapian_settings.verbose>0) i_info("FTS Xapian : Closing thread because not started : %s",xw->getSummary().c_str());
-			delete(xw);
-			backend->threads.pop_back();
+			syslog(LOG_INFO,"FTS Xapian : Waiting (Sleep4) for %ld writers",w);
+			n=0;
 		}
-		else if(xw->terminated)
+		std::this_thread::sleep_for(XAPIAN_SLEEP);
+	}
+	if(backend->err && !err)
+	{
+		// Failed while finishing the last docs
+		err=true;
+		strcpy(reason,backend->err_s);
+		while(backend->docs.size()>0)
 		{
-			if(fts_xapian_settings.verbose>0) i_info("FTS Xapian : Closing thread because terminated : %s",xw->getSummary().c_str());
-			delete(xw);
-			backend->threads.pop_back();
+			XDoc * doc = backend->docs.back();
+			backend->docs.pop_back();
+			delete(doc);
 		}
-		else
+		struct stat sb; 
+		if((stat(backend->version_file, &sb)==0) && S_ISREG(sb.st_mode))
 		{
-			n++;
-			if((n>50) && (fts_xapian_settings.verbose>0)) 
-			{
-				for(auto & xwr : backend->threads)
-				{
-					if((xwr!=NULL)&&(!(xwr->terminated))) i_info("FTS Xapian : Waiting (Sleep4) for thread %s",xwr->getSummary().c_str());
-				}
-				n=0;
-			}
-			std::this_thread::sleep_for(XAPIAN_SLEEP);
+			std::filesystem::remove(backend->version_file);
 		}
 	}
-	if(fts_xapian_settings.verbose>0) i_info("FTS Xapian : All DWs (%s) closed",reason);
-
-	if(!err) fts_backend_xapian_sqlite3_dict_flush(backend,fts_xapian_settings.verbose);
+	backend->err=false;
+	backend->err_s[0]=0;
+	fts_backend_xapian_spool_close(backend);
+	if(fts_xapian_settings.verbose>0) syslog(LOG_INFO,"FTS Xapian : Queue of '%s' (%s) closed",backend->boxname,reason);
 
-	sqlite3_close(backend->ddb);
-	backend->ddb = NULL;
+	if((!err) && (!backend->bulk) && (backend->dbw!=NULL)) backend->bloom->save(backend->bloom_db,false);
 
 	if(backend->dbw!=NULL)
 	{
-		fts_backend_xapian_close_db(backend->dbw,backend->xap_db,backend->boxname,fts_xapian_settings.verbose);
+		fts_backend_xapian_close_db(backend->dbw,backend->bulk ? backend->bulk_db : backend->xap_db,backend->boxname,fts_xapian_settings.verbose);
 		backend->dbw=NULL;
 	}
+	backend->uncommitted->clear();
+
+	if(backend->bulk) fts_backend_xapian_bulk_finish(backend,err);
+
+	if(!err) fts_backend_xapian_sqlite3_dict_flush(backend,fts_xapian_settings.verbose);
+	backend->dict->clear();
+
+	sqlite3_close(backend->ddb);
+	backend->ddb = NULL;
 }
 
-XResultSet * fts_backend_xapian_query(Xapian::Database * dbx, XQuerySet * query, long limit=0)
+XResultSet * fts_backend_xapian_query(Xapian::Database * dbx, XQuerySet * query, long limit=0, long timeout=0)
 {
 	if(fts_xapian_settings.verbose>0) i_info("FTS Xapian: fts_backend_xapian_query (%s)",query->get_string().c_str());
 
 	XResultSet * set= new XResultSet();
 	Xapian::Query * q = query->get_query(dbx);
+	long start_time = fts_backend_xapian_current_time();
 
 	try
 	{
 		Xapian::Enquire enquire(*dbx);
 		enquire.set_query(*q);
 		enquire.set_docid_order(Xapian::Enquire::DESCENDING);
+		if(timeout>0) enquire.set_time_limit(timeout/1000.0f);
 
 		long offset=0;
 		long pagesize=100; if(limit>0) { pagesize=std::min(pagesize,limit); }
@@ -1282,13 +3613,26 @@ XResultSet * fts_backend_xapian_query(Xapian::Database * dbx, XQuerySet * query,
 			Xapian::MSetIterator i = m.begin();
 			while (i != m.end())
 			{
+				if((limit>0) && (set->size>=limit))
+				{
+					set->truncated=true;
+					break;
+				}
 				Xapian::Document doc = i.get_document();
 				set->add(doc.get_docid());
 				i++;
 			}
+			if(set->truncated) break;
+			if((timeout>0) && (fts_backend_xapian_current_time() - start_time >= timeout))
+			{
+				set->truncated=true;
+				break;
+			}
 			offset+=pagesize;
 			m = enquire.get_mset(offset, pagesize);
 		}
+		// A page cut short by the time limit ends the loop as if the results were complete
+		if((timeout>0) && (fts_backend_xapian_current_time() - start_time >= timeout)) set->truncated=true;
 	}
 	catch(Xapian::Error e)
 	{
@@ -1298,11 +3642,189 @@ XResultSet * fts_backend_xapian_query(Xapian::Database * dbx, XQuerySet * query,
 	return set;
 }
 
+// Adds the UIDs which have a doc in the index (up to last) : without gaps, the doc count is enough
+static void fts_backend_xapian_indexed_uids(Xapian::Database * dbx, uint32_t last, ARRAY_TYPE(seq_range) * uids)
+{
+	try
+	{
+		if(dbx->get_doccount() >= last)
+		{
+			seq_range_array_add_range(uids,1,last);
+			return;
+		}
+		for(Xapian::ValueIterator v = dbx->valuestream_begin(1); v != dbx->valuestream_end(1); ++v)
+		{
+			seq_range_array_add(uids,(uint32_t)Xapian::sortable_unserialise(*v));
+		}
+	}
+	catch(Xapian::Error e)
+	{
+		i_error("FTS Xapian: Can not list the indexed UIDs : %s",e.get_msg().c_str());
+	}
+}
+
+// Adds the UIDs of the docs matching the query, returns false if the results were truncated
+static bool fts_backend_xapian_query_uids(Xapian::Database * dbx, XQuerySet * query, ARRAY_TYPE(seq_range) * uids, long limit=0, long timeout=0)
+{
+	XResultSet * r=fts_backend_xapian_query(dbx,query,limit,timeout);
+	bool complete = !(r->truncated);
+
+	for(long i=0;i<r->size;i++)
+	{
+		try
+		{
+			seq_range_array_add(uids,Xapian::sortable_unserialise(dbx->get_document(r->data[i]).get_value(1)));
+		}
+		catch(Xapian::Error e)
+		{
+			i_error("FTS Xapian: %s",e.get_msg().c_str());
+		}
+	}
+	delete(r);
+	return complete;
+}
+
+// Mailbox being drained and committed in background
+class XCloser
+{
+	public:
+		std::string db;
+		std::thread * t;
+		bool done;
+};
+
+static std::mutex fts_xapian_closers_m;
+static std::vector<XCloser *> fts_xapian_closers;
+
+static void fts_backend_xapian_closer(XCloser * c, struct xapian_fts_backend * old)
+{
+	fts_backend_xapian_close(old,"background close");
+
+	i_free(old->path); i_free(old->guid); i_free(old->boxname);
+	i_free(old->xap_db); i_free(old->exp_db); i_free(old->dict_db);
+	i_free(old->bulk_db); i_free(old->bloom_db); i_free(old->version_file);
+	delete(old->dict);
+	delete(old->bloom);
+	delete(old->uncommitted);
+	delete(old);
+
+	std::lock_guard<std::mutex> lck(fts_xapian_closers_m);
+	c->done=true;
+}
+
+// Waits for the background closers of a DB (all of them if NULL), and cleans up the finished ones
+static long fts_backend_xapian_closers_wait(const char * db)
+{
+	std::vector<XCloser *> w;
+	long n=0;
+	{
+		std::lock_guard<std::mutex> lck(fts_xapian_closers_m);
+		for(unsigned long i=0;i<fts_xapian_closers.size();)
+		{
+			XCloser * c = fts_xapian_closers[i];
+			if(c->done || (db==NULL) || (c->db.compare(db)==0))
+			{
+				w.push_back(c);
+				fts_xapian_closers.erase(fts_xapian_closers.begin()+i);
+			}
+			else i++;
+		}
+		n = fts_xapian_closers.size();
+	}
+	for(auto & c : w)
+	{
+		if((!(c->done)) && (fts_xapian_settings.verbose>0)) i_info("FTS Xapian: Waiting for the background commit of %s",c->db.c_str());
+		c->t->join();
+		delete(c->t);
+		delete(c);
+	}
+	return n;
+}
+
+// Hands the pipeline of the mailbox (queue, writable DBs, dict, filter) to a background closer,
+// so that the next mailbox starts at once. Returns false if it has to be closed synchronously.
+static bool fts_backend_xapian_close_async(struct xapian_fts_backend *backend)
+{
+	long verbose = fts_xapian_settings.verbose;
+	if(backend->err || (!(backend->attached))) return false;
+
+	// Memory cap : number of mailboxes in background, and free memory
+	long m = fts_backend_xapian_get_free_memory(verbose);
+	if(fts_backend_xapian_closers_wait("") >= XAPIAN_MAX_CLOSING) return false; // only cleans up the finished ones
+	if((m>0) && (m < (fts_xapian_settings.lowmemory*2048))) return false;
+
+	// The writers finish the doc of the mailbox they are on, but take no new one :
+	// they write through this backend, so the handoff waits for them (the only synchronous wait here)
+	if(backend->attached) fts_backend_xapian_pool_detach(backend);
+	while(true)
+	{
+		fts_backend_xapian_get_lock(backend, verbose, "close async");
+		long w = backend->writers;
+		fts_backend_xapian_release_lock(backend, verbose, "close async");
+		if(w<1) break;
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	}
+	if(backend->err) return false;
+
+	struct xapian_fts_backend * old = new xapian_fts_backend();
+	old->path = i_strdup(backend->path);
+	old->guid = i_strdup(backend->guid);
+	old->boxname = i_strdup(backend->boxname);
+	old->xap_db = i_strdup(backend->xap_db);
+	old->exp_db = i_strdup(backend->exp_db);
+	old->dict_db = i_strdup(backend->dict_db);
+	old->bulk_db = i_strdup(backend->bulk_db);
+	old->bloom_db = i_strdup(backend->bloom_db);
+	old->version_file = i_strdup(backend->version_file);
+	old->bulk = backend->bulk; backend->bulk = false;
+	old->bulk_fd = backend->bulk_fd; backend->bulk_fd = -1;
+	old->bulk_done = backend->bulk_done; backend->bulk_done = NULL;
+	old->bulk_busy = false; backend->bulk_busy = false;
+	old->dict = backend->dict; backend->dict = new XDict();
+	old->bloom = backend->bloom; backend->bloom = new XBloom();
+	old->ddb = backend->ddb; backend->ddb = NULL;
+	old->dbw = backend->dbw; backend->dbw = NULL;
+	old->uncommitted = backend->uncommitted; backend->uncommitted = new std::unordered_map<long,bool>();
+	old->pending = backend->pending; backend->pending = 0;
+	old->spool_fd = backend->spool_fd; backend->spool_fd = -1;
+	old->spool_size = backend->spool_size; backend->spool_size = 0;
+	old->spool_docs = backend->spool_docs; backend->spool_docs = 0;
+	old->docs.swap(backend->docs);
+	old->max_threads = backend->max_threads;
+	old->mutex_t = NULL;
+	old->lastuid = -1;
+	backend->lastuid = -1;
+
+	if(verbose>0) i_info("FTS Xapian: Committing '%s' in background (%ld docs queued)",old->boxname,(long)old->docs.size());
+	fts_backend_xapian_pool_attach(old,"background close");
+
+	XCloser * c = new XCloser();
+	c->db = old->xap_db;
+	c->done = false;
+	try
+	{
+		std::lock_guard<std::mutex> lck(fts_xapian_closers_m);
+		c->t = new std::thread(fts_backend_xapian_closer,c,old);
+		fts_xapian_closers.push_back(c);
+	}
+	catch(std::exception const& e)
+	{
+		i_warning("FTS Xapian: Can not commit '%s' in background : %s",old->boxname,e.what());
+		delete(c);
+		c = new XCloser();
+		c->done = true;
+		c->t = NULL;
+		fts_backend_xapian_closer(c,old);
+		delete(c);
+	}
+	return true;
+}
+
 static int fts_backend_xapian_unset_box(struct xapian_fts_backend *backend)
 {
 	if(fts_xapian_settings.verbose>1) i_info("FTS Xapian: Unset box '%s' (%s)",backend->boxname,backend->guid);
 
-	fts_backend_xapian_close(backend,"unset box");
+	if(!fts_backend_xapian_close_async(backend)) fts_backend_xapian_close(backend,"unset box");
 	fts_backend_xapian_oldbox(backend);
 
 	if(backend->xap_db != NULL)
@@ -1322,6 +3844,12 @@ static int fts_backend_xapian_unset_box(struct xapian_fts_backend *backend)
 		i_free(backend->dict_db);
 		backend->dict_db = NULL;
 
+		i_free(backend->bulk_db);
+		backend->bulk_db = NULL;
+
+		i_free(backend->bloom_db);
+		backend->bloom_db = NULL;
+
 		i_free(backend->version_file);
 		backend->version_file = NULL;
 	}
@@ -1395,8 +3923,15 @@ static int fts_backend_xapian_set_box(struct xapian_fts_backend *backend, struct
 	backend->guid = i_strdup(mb);
 	backend->boxname = i_strdup(box->name);
 	backend->xap_db = i_strdup_printf("%s/db_%s",backend->path,mb);
+	fts_backend_xapian_closers_wait(backend->xap_db); // still being committed in background
 	backend->exp_db = i_strdup_printf("%s%s",backend->xap_db,suffixExp);
 	backend->dict_db = i_strdup_printf("%s%s",backend->xap_db,suffixDict);
+	backend->bulk_db = i_strdup_printf("%s%s",backend->xap_db,suffixBulk);
+	backend->bulk = false;
+	backend->bulk_busy = false;
+	fts_backend_xapian_bulk_release(backend);
+	backend->bloom_db = i_strdup_printf("%s%s",backend->xap_db,suffixBloom);
+	backend->bloom->clear();
 	backend->version_file = i_strdup_printf("%s_v%s",backend->xap_db,XAPIAN_PLUGIN_VERSION);
 
 	struct stat sb;
@@ -1407,6 +3942,7 @@ static int fts_backend_xapian_set_box(struct xapian_fts_backend *backend, struct
 
 		// Deleting existing indexes
 		std::filesystem::remove_all(backend->xap_db);
+		std::filesystem::remove_all(backend->bulk_db);
 		for(auto& f : std::filesystem::directory_iterator(backend->path)) 
 		{
 			if((f.is_regular_file()) && (f.path().string().find(backend->xap_db) == 0))
@@ -1422,16 +3958,21 @@ static int fts_backend_xapian_set_box(struct xapian_fts_backend *backend, struct
 		fclose(f);
 	}
 
+	// A DB being bulk indexed (and swapped) by another process is left as is
+	bool busy = fts_backend_xapian_bulk_locked(backend);
+	if(busy && (fts_xapian_settings.verbose>0)) i_info("FTS Xapian: '%s' (%s) is being bulk indexed by another process",backend->boxname,backend->guid);
+
 	// Verify existence of Dict db
 	if(!( (stat(backend->dict_db, &sb)==0) && S_ISREG(sb.st_mode)))
 	{
 		i_warning("FTS Xapian: '%s' (%s) dictionnary does not exist. Creating it",backend->boxname,backend->dict_db);
 		if(fts_backend_xapian_sqlite3_dict_open(backend)) sqlite3_close(backend->ddb);
 		backend->ddb = NULL;
-		std::filesystem::remove_all(backend->xap_db);
+		if(!busy) std::filesystem::remove_all(backend->xap_db);
 	}
 	
 	// Verify existence of Xapian db
+	if(!busy)
 	{
 		char * t = i_strdup_printf("%s/termlist.glass",backend->xap_db);
 		if(!( (stat(t, &sb)==0) && S_ISREG(sb.st_mode)))
@@ -1443,6 +3984,11 @@ static int fts_backend_xapian_set_box(struct xapian_fts_backend *backend, struct
 				Xapian::WritableDatabase * db = new Xapian::WritableDatabase(backend->xap_db,Xapian::DB_CREATE_OR_OVERWRITE | Xapian::DB_BACKEND_GLASS);
 				db->close();
 				delete(db);
+
+				// Empty filter for the new (empty) DB
+				std::filesystem::remove(backend->bloom_db);
+				XBloom b;
+				b.save(backend->bloom_db,true);
 			}
 			catch(Xapian::Error e)
 			{
@@ -1473,15 +4019,149 @@ static int fts_backend_xapian_set_box(struct xapian_fts_backend *backend, struct
 		}
 	}
 
-	backend->threads.clear();
 	backend->total_docs =0;
 
 	return 0;
 }
 
-static void fts_backend_xapian_build_qs(XQuerySet * qs, struct mail_search_arg *a, const char * dict=NULL)
+static bool fts_backend_xapian_bloom_check(XBloom * bloom, struct mail_search_arg *a, bool and_args)
+{
+	long n=0, found=0;
+
+	while(a != NULL)
+	{
+		bool text=false, may=true;
+		switch (a->type)
+		{
+			case SEARCH_TEXT:
+			case SEARCH_BODY:
+			case SEARCH_HEADER:
+			case SEARCH_HEADER_ADDRESS:
+			case SEARCH_HEADER_COMPRESS_LWSP:
+				text=true;
+				break;
+			default:
+				break;
+		}
+		if(text && (!a->match_not))
+		{
+			if((a->value.str == NULL) || (strlen(a->value.str)<1))
+			{
+				may = fts_backend_xapian_bloom_check(bloom,a->value.subargs,false);
+			}
+			else
+			{
+				// All the keywords are required
+				icu::StringPiece sp(a->value.str);
+				icu::UnicodeString t = icu::UnicodeString::fromUTF8(sp);
+				fts_backend_xapian_clean(&t);
+				long i;
+				do
+				{
+					i = t.lastIndexOf(CHAR_SPACE);
+					icu::UnicodeString k(t,i+1);
+					if((k.length() >= (long)fts_xapian_settings.partial) && (k.length() < XAPIAN_TERM_SIZELIMIT/2) && (!bloom->may_contain(&k))) may=false;
+					if(i>=0)
+					{
+						t.truncate(i);
+						fts_backend_xapian_trim(&t);
+					}
+				}
+				while((i>=0) && may);
+			}
+		}
+		if(text)
+		{
+			n++;
+			if(may) found++;
+			if(and_args && (!may)) return false;
+		}
+		a = a->next;
+	}
+	return (n==0) || (found>0);
+}
+
+static void fts_backend_xapian_expand_dict(sqlite3 * db, icu::UnicodeString * k, long hdr, long maxk, std::vector<icu::UnicodeString *> * st, XDict * pending)
+{
+	std::string sql=searchDict1;
+	k->toUTF8String(sql);
+	if(hdr<0)
+	{
+		sql+="%'";
+	}
+	else
+	{
+		sql+="%' and header=" + std::to_string(hdr);
+	}
+	sql +=searchDict2 + std::to_string(maxk);
+
+	char * zErrMsg =0;
+	if(sqlite3_exec(db,sql.c_str(),fts_backend_xapian_sqlite3_vector_icu,st,&zErrMsg) != SQLITE_OK )
+	{
+		syslog(LOG_ERR,"FTS Xapian: Can not search keyword (%s) : %s",sql.c_str(),zErrMsg);
+		if(zErrMsg!=NULL) sqlite3_free(zErrMsg);
+	}
+
+	if((pending == NULL) || ((long)st->size()>=maxk)) return;
+
+	std::set<std::string> found;
+	std::string w;
+	for(auto & t : *st)
+	{
+		w.clear();
+		t->toUTF8String(w);
+		found.insert(w);
+	}
+	long n = found.size();
+	w.clear();
+	k->toUTF8String(w);
+	pending->search(w,hdr,maxk,found);
+	if((long)found.size() == n) return;
+
+	for(auto & t : *st) delete(t);
+	st->clear();
+	for(auto & word : found) st->push_back(new icu::UnicodeString(icu::UnicodeString::fromUTF8(icu::StringPiece(word))));
+}
+
+static void fts_backend_xapian_expand_prefix(Xapian::Database * dbx, icu::UnicodeString * k, long hdr, long maxk, std::vector<icu::UnicodeString *> * st)
+{
+	std::string w;
+	k->toUTF8String(w);
+
+	// Range scan of the term B-tree, for each searched header
+	std::set<std::string> words;
+	for(long i=1;(i<HDRS_NB-1) && ((long)words.size()<maxk);i++)
+	{
+		if((hdr>=0) && (i!=hdr)) continue;
+		std::string p(hdrs_xapian[i]);
+		p.append(w);
+		try
+		{
+			Xapian::TermIterator t = dbx->allterms_begin(p);
+			while((t != dbx->allterms_end(p)) && ((long)words.size()<maxk))
+			{
+				words.insert((*t).substr(strlen(hdrs_xapian[i])));
+				t++;
+			}
+		}
+		catch(Xapian::Error e)
+		{
+			syslog(LOG_ERR,"FTS Xapian: Can not scan terms (%s) : %s",p.c_str(),e.get_msg().c_str());
+		}
+	}
+
+	for(auto & word : words)
+	{
+		if(fts_xapian_settings.verbose>0) i_info("FTS Xapian: expand_prefix : Adding %s",word.c_str());
+		st->push_back(new icu::UnicodeString(icu::UnicodeString::fromUTF8(icu::StringPiece(word))));
+	}
+}
+
+static bool fts_backend_xapian_build_qs(XQuerySet * qs, struct mail_search_arg *a, const char * dict=NULL, long * expansion=NULL, Xapian::Database * dbx=NULL, XDict * pending=NULL)
 {
 	long hdr;
+	bool complete=true;
+	bool prefix=(dbx!=NULL) && (fts_xapian_settings.partial_mode!=NULL) && (strcmp(fts_xapian_settings.partial_mode,XAPIAN_PARTIAL_PREFIX)==0);
 
 	if(fts_xapian_settings.verbose>1) i_info("FTS Xapian: fts_backend_xapian_build_qs");
 
@@ -1501,21 +4181,19 @@ static void fts_backend_xapian_build_qs(XQuerySet * qs, struct mail_search_arg *
 				}
 				hdr=fts_backend_xapian_clean_header(a->hdr_field_name); 
 				if(hdr >= 0) break;
+				a = a->next; continue;
+			case SEARCH_UIDSET:
+				// Not marked as matched : Dovecot still checks the UIDs, the filter just narrows the scan
+				if((!a->match_not) && qs->restrict(&(a->value.seqset)) && (fts_xapian_settings.verbose>1)) i_info("FTS Xapian: UID set pushed down");
+				a = a->next; continue;
 			default: a = a->next; continue;
 		}
 
 		if((a->value.str == NULL) || (strlen(a->value.str)<1))
 		{
-			XQuerySet * q2;
-			if(a->match_not)
-			{
-				q2 = new XQuerySet(Xapian::Query::OP_AND_NOT,qs->limit);
-			}
-			else
-			{
-				q2 = new XQuerySet(Xapian::Query::OP_OR,qs->limit);
-			}
-			fts_backend_xapian_build_qs(q2,a->value.subargs,dict);
+			XQuerySet * q2 = new XQuerySet(Xapian::Query::OP_OR,qs->limit);
+			if(a->match_not) q2->negate();
+			if(!fts_backend_xapian_build_qs(q2,a->value.subargs,dict,expansion,dbx,pending)) complete=false;
 			if(q2->count()>0)
 			{
 				qs->add(q2);
@@ -1525,7 +4203,7 @@ static void fts_backend_xapian_build_qs(XQuerySet * qs, struct mail_search_arg *
 				delete(q2);
 			}
 		}
-		else if(dict != NULL)
+		else if((dict != NULL) || prefix)
 		{
 			// Find key words
 			icu::StringPiece sp(a->value.str);
@@ -1551,45 +4229,47 @@ static void fts_backend_xapian_build_qs(XQuerySet * qs, struct mail_search_arg *
 				keys.push_back(new icu::UnicodeString (t));
 			}
 
-			// For each key, search dictionnary
+			// For each key, search dictionnary (or the Xapian terms directly in prefix mode)
 			sqlite3 * db = NULL;
-			char * zErrMsg =0;
-			if(sqlite3_open_v2(dict,&db,SQLITE_OPEN_FULLMUTEX | SQLITE_OPEN_READONLY,NULL) != SQLITE_OK )
+			if((!prefix) && (sqlite3_open_v2(dict,&db,SQLITE_OPEN_FULLMUTEX | SQLITE_OPEN_READONLY,NULL) != SQLITE_OK))
 			{
 				syslog(LOG_ERR,"FTS Xapian: Can not open %s : %s",dict,sqlite3_errmsg(db));
-				return;
+				for(auto & ki : keys) delete(ki);
+				return complete;
 			}
 
 			// Generate query
 			XQuerySet * q1, *q2;
-			if(a->match_not)
-			{
-				q1 = new XQuerySet(Xapian::Query::OP_AND_NOT,qs->limit);
-			}
-			else
-			{
-				q1 = new XQuerySet(Xapian::Query::OP_AND,qs->limit);
-			}	
+			q1 = new XQuerySet(Xapian::Query::OP_AND,qs->limit);
+			if(a->match_not) q1->negate();
 			for(auto & ki : keys)
 			{
+				// Expansion budget exhausted : the remaining keywords are ignored
+				long maxk=100;
+				if(expansion!=NULL)
+				{
+					if(*expansion<1)
+					{
+						complete=false;
+						delete(ki);
+						continue;
+					}
+					maxk=std::min(maxk,*expansion);
+				}
+
 				std::vector<icu::UnicodeString *> st; st.clear();
-				std::string sql=searchDict1;
-				ki->toUTF8String(sql);
-				if(hdr<0)
+				if(prefix)
 				{
-					sql+="%'";
+					fts_backend_xapian_expand_prefix(dbx,ki,hdr,maxk,&st);
 				}
 				else
 				{
-					sql+="%' and header=" + std::to_string(hdr);
+					fts_backend_xapian_expand_dict(db,ki,hdr,maxk,&st,pending);
 				}
-				sql +=searchDict2;
-				
-				zErrMsg =0;
-				if(sqlite3_exec(db,sql.c_str(),fts_backend_xapian_sqlite3_vector_icu,&st,&zErrMsg) != SQLITE_OK )
+				if(expansion!=NULL)
 				{
-					syslog(LOG_ERR,"FTS Xapian: Can not search keyword (%s) : %s",sql.c_str(),zErrMsg);
-					if(zErrMsg!=NULL) sqlite3_free(zErrMsg);
+					if((maxk<100) && ((long)st.size()>=maxk)) complete=false;
+					*expansion -= st.size();
 				}
 				q2 = new XQuerySet(Xapian::Query::OP_OR,qs->limit);
 				for(auto &term : st)
@@ -1597,11 +4277,20 @@ static void fts_backend_xapian_build_qs(XQuerySet * qs, struct mail_search_arg *
 					q2->add(hdr,term,false);
 					delete(term);
 				}
-				if(q2->count()>0) { q1->add(q2); } else { delete(q2); }
+				if(q2->count()>0) 
+				{ 
+					q1->add(q2); 
+				} 
+				else 
+				{ 
+					// Required word unknown to the dictionary : the arg can not match
+					delete(q2);
+					q1->match_nothing();
+				}
 				delete(ki);
 			}
 			qs->add(q1);
-			sqlite3_close(db);
+			if(db!=NULL) sqlite3_close(db);
 		}
 		else
 		{
@@ -1614,4 +4303,5 @@ static void fts_backend_xapian_build_qs(XQuerySet * qs, struct mail_search_arg *
 		a->match_always=true;
 		a = a->next;
 	}
+	return complete;
 }
@@ -4,12 +4,21 @@
 #include <thread>
 #include <cstdio>
 #include <vector>
+#include <set>
+#include <unordered_set>
+#include <unordered_map>
+#include <list>
 #include <mutex>
+#include <condition_variable>
+#include <atomic>
 #include <regex>
 #include <chrono>
 #include <cmath>
+#include <algorithm>
+#include <string_view>
 extern "C" {
 #include "fts-xapian-plugin.h"
+#include "sha2.h"
 }
 #include "fts-backend-xapian.h"
 #include <dirent.h>
@@ -25,11 +34,17 @@ extern "C" {
 #include <pwd.h>
 #include <grp.h>
 #include <sys/stat.h>
+#include <fcntl.h>
+#include <sys/file.h>
 
 #include <syslog.h>
 
 class XDoc;
 class XDocsWriter;
+class XDict;
+class XBloom;
+class XHtml;
+class XQuotes;
 
 struct xapian_fts_backend
 {
@@ -43,17 +58,35 @@ struct xapian_fts_backend
 	char * exp_db;
 	char * version_file;
 	char * dict_db;
-	long dict_nb;
+	XDict * dict;
+
+	bool bulk;
+	char * bulk_db;
+	int bulk_fd; // lock of the bulk indexing, held until the swap
+	bool bulk_busy; // bulk indexing of the mailbox by another process
+	std::unordered_set<long> * bulk_done; // docs already in a bulk DB resumed after a crash
+	long messages;
+
+	XBloom * bloom;
+	char * bloom_db;
 
 	sqlite3 * ddb;
 	Xapian::WritableDatabase * dbw;
 	long pending;
+	std::unordered_map<long,bool> * uncommitted; // docs queued or written (true) but not committed, not bulk
+
+	int spool_fd; // overflow of the queue
+	off_t spool_size;
+	long spool_docs; // docs in the spool file, not read back yet
 
 	char * old_guid;
 	char * old_boxname;
 
 		  std::vector<XDoc *> docs;
-	std::vector<XDocsWriter *> threads;
+	bool attached; // to the writers pool
+	long writers; // nb of writers processing a doc of this backend
+	bool err;
+	char err_s[10000];
 	std::timed_mutex mutex;
 	std::unique_lock<std::timed_mutex> * mutex_t;
 	unsigned int max_threads;
@@ -72,6 +105,8 @@ struct xapian_fts_backend_update_context
 	struct fts_backend_update_context ctx;
 	char * tbi_field=NULL;
 	bool isattachment=false;
+	XHtml * html=NULL; // text/html part being received
+	XQuotes * quotes=NULL; // text/plain body without the quoted replies
 	bool tbi_isfield;
 	uint32_t tbi_uid=0;
 };
@@ -104,15 +139,31 @@ static int fts_backend_xapian_init(struct fts_backend *_backend, const char **er
 	backend->xap_db = NULL;
 	backend->exp_db = NULL;
 	backend->dict_db = NULL;
+	backend->bulk_db = NULL;
+	backend->bulk = false;
+	backend->bulk_fd = -1;
+	backend->bulk_busy = false;
+	backend->bulk_done = NULL;
+	backend->messages = 0;
+	backend->bloom_db = NULL;
+	backend->bloom = new XBloom();
 
 	backend->docs.clear();
-	backend->threads.clear();
+	backend->spool_fd = -1;
+	backend->spool_size = 0;
+	backend->spool_docs = 0;
+	backend->attached = false;
+	backend->writers = 0;
+	backend->err = false;
+	backend->err_s[0] = 0;
 	backend->total_docs =0;
 	
 	backend->lastuid = -1;
 
 	backend->dbw = NULL;
+	backend->uncommitted = new std::unordered_map<long,bool>();
 	backend->ddb = NULL;
+	backend->dict = new XDict();
 	backend->guid = NULL;
 	backend->path = NULL;
 	backend->old_guid = NULL;
@@ -132,7 +183,25 @@ static int fts_backend_xapian_init(struct fts_backend *_backend, const char **er
 	fts_xapian_settings.verbose = fuser->set->verbose;
 	fts_xapian_settings.maxthreads = fuser->set->maxthreads;
 	fts_xapian_settings.partial = fuser->set->partial;
+	fts_xapian_settings.partial_mode = fuser->set->partial_mode;
+	fts_xapian_settings.dictmode = fuser->set->dictmode;
+	fts_xapian_settings.tokenize = fuser->set->tokenize;
 	fts_xapian_settings.lowmemory = fuser->set->lowmemory;
+	fts_xapian_settings.bulk = fuser->set->bulk;
+	fts_xapian_settings.querytimeout = fuser->set->querytimeout;
+	fts_xapian_settings.queryterms = fuser->set->queryterms;
+	fts_xapian_settings.querydocs = fuser->set->querydocs;
+	fts_xapian_settings.querycache = fuser->set->querycache;
+	fts_xapian_settings.termscache = fuser->set->termscache;
+	fts_xapian_settings.attachcache = fuser->set->attachcache;
+	fts_xapian_settings.attachcache_mode = fuser->set->attachcache_mode;
+	fts_xapian_settings.junkmode = fuser->set->junkmode;
+	fts_xapian_settings.junklength = fuser->set->junklength;
+	fts_xapian_settings.quotes = fuser->set->quotes;
+	fts_xapian_settings.fieldbytes = fuser->set->fieldbytes;
+	fts_xapian_settings.fieldterms = fuser->set->fieldterms;
+	fts_xapian_settings.skipfields = fuser->set->skipfields;
+	fts_xapian_settings.attachbytes = fuser->set->attachbytes;
 #else	
 	fts_xapian_settings = fuser->set;
 #endif
@@ -147,11 +216,21 @@ static int fts_backend_xapian_init(struct fts_backend *_backend, const char **er
 	}
 	if(backend->max_threads<2) backend->max_threads = 2;
 
+	// The 2.3 parser checks the junk length against the default partial length only
+	if(fts_xapian_settings.junklength < fts_xapian_settings.partial)
+	{
+		i_warning("FTS Xapian: 'junklength' (%u) lower than 'partial' (%u), using %u",fts_xapian_settings.junklength,fts_xapian_settings.partial,fts_xapian_settings.partial);
+		fts_xapian_settings.junklength = fts_xapian_settings.partial;
+	}
+
+	fts_backend_xapian_budgets_init();
+
 	if(fts_backend_xapian_set_path(backend)<0) return -1;
+	fts_backend_xapian_attachcache_load(backend);
 
 	openlog("xapian-docswriter",0,LOG_MAIL);
 
-	if(fts_xapian_settings.verbose>0) i_info("FTS Xapian: Starting version %s with partial=%d verbose=%d max_threads=%u lowmemory=%d MB", XAPIAN_PLUGIN_VERSION, fts_xapian_settings.partial,fts_xapian_settings.verbose,backend->max_threads,fts_xapian_settings.lowmemory);
+	if(fts_xapian_settings.verbose>0) i_info("FTS Xapian: Starting version %s with partial=%d partial_mode=%s dictmode=%s tokenize=%s verbose=%d max_threads=%u lowmemory=%d MB bulk=%d querytimeout=%d ms queryterms=%d querydocs=%d termscache=%d attachcache=%d (%s) junkmode=%s junklength=%d quotes=%s fieldbytes=%s fieldterms=%s skipfields=%s attachbytes=%d", XAPIAN_PLUGIN_VERSION, fts_xapian_settings.partial,fts_xapian_settings.partial_mode,fts_xapian_settings.dictmode,fts_xapian_settings.tokenize,fts_xapian_settings.verbose,backend->max_threads,fts_xapian_settings.lowmemory,fts_xapian_settings.bulk,fts_xapian_settings.querytimeout,fts_xapian_settings.queryterms,fts_xapian_settings.querydocs,fts_xapian_settings.termscache,fts_xapian_settings.attachcache,fts_xapian_settings.attachcache_mode,fts_xapian_settings.junkmode,fts_xapian_settings.junklength,fts_xapian_settings.quotes,fts_xapian_settings.fieldbytes,fts_xapian_settings.fieldterms,fts_xapian_settings.skipfields,fts_xapian_settings.attachbytes);
 
 	return 0;
 }
@@ -161,8 +240,14 @@ static void fts_backend_xapian_deinit(struct fts_backend *_backend)
 	struct xapian_fts_backend *backend = (struct xapian_fts_backend *)_backend;
 
 	if(fts_xapian_settings.verbose>1) i_info("FTS Xapian: Deinit %s)",backend->path);
+	if(fts_xapian_settings.verbose>0) i_info("FTS Xapian: Query cache hits=%ld misses=%ld",fts_xapian_querycache.hits,fts_xapian_querycache.misses);
+	if(fts_xapian_settings.verbose>0) i_info("FTS Xapian: Terms cache hits=%ld misses=%ld",fts_xapian_termscache.hits,fts_xapian_termscache.misses);
+	if(fts_xapian_settings.verbose>0) i_info("FTS Xapian: Junk keywords dropped=%ld truncated=%ld (%ld chars removed)",fts_xapian_junk_dropped.load(),fts_xapian_junk_truncated.load(),fts_xapian_junk_chars.load());
+	if(fts_xapian_settings.verbose>0) i_info("FTS Xapian: Quoted replies skipped=%ld bytes",fts_xapian_quotes_dropped);
 
 	if(backend->guid != NULL) fts_backend_xapian_unset_box(backend);
+	fts_backend_xapian_closers_wait(NULL);
+	fts_backend_xapian_attachcache_save(backend);
 
 	if(backend->old_guid != NULL) i_free(backend->old_guid);
 	backend->old_guid = NULL;
@@ -173,6 +258,13 @@ static void fts_backend_xapian_deinit(struct fts_backend *_backend)
 	if(backend->path != NULL) i_free(backend->path);
 	backend->path = NULL;
 
+	delete(backend->dict);
+	backend->dict = NULL;
+
+	delete(backend->bloom);
+	delete(backend->uncommitted);
+	backend->bloom = NULL;
+
 #ifdef FTS_DOVECOT24
 	event_unref(&backend->event);
 #endif
@@ -216,6 +308,7 @@ static int fts_backend_xapian_get_last_uid(struct fts_backend *_backend, struct
 
 	dbr->close();
 	delete(dbr);
+
 	if(fts_xapian_settings.verbose>1) i_info("FTS Xapian: Get last UID of %s (%s) = %d",backend->boxname,backend->guid,*last_uid_r);
 
 	return 0;
@@ -240,6 +333,8 @@ static int fts_backend_xapian_update_deinit(struct fts_backend_update_context *_
 
 	if(fts_xapian_settings.verbose>1) i_info("FTS Xapian: fts_backend_xapian_update_deinit (%s)",backend->path);
 
+	if(ctx->html!=NULL) delete(ctx->html);
+	if(ctx->quotes!=NULL) delete(ctx->quotes);
 	i_free(ctx);
 
 	return 0;
@@ -253,6 +348,23 @@ static void fts_backend_xapian_update_set_mailbox(struct fts_backend_update_cont
 	struct xapian_fts_backend *backend = (struct xapian_fts_backend *)ctx->ctx.backend;
 
 	fts_backend_xapian_set_box(backend, box);
+
+	// Size of the mailbox, for the choice of the bulk mode
+	backend->messages = 0;
+	if((box != NULL) && (fts_xapian_settings.bulk>0))
+	{
+		struct mailbox_status status;
+		mailbox_get_open_status(box, STATUS_MESSAGES, &status);
+		backend->messages = status.messages;
+	}
+
+	// First indexing of a large mailbox : built in bulk mode, unless another process is already doing it.
+	// Decided once per update, from the DB itself
+	backend->bulk_busy = false;
+	if((box != NULL) && (backend->guid != NULL) && (!backend->bulk) && (backend->dbw == NULL) && (backend->docs.size() == 0))
+	{
+		backend->bulk_busy = !fts_backend_xapian_bulk_start(backend);
+	}
 }
 
 static void fts_backend_xapian_update_expunge(struct fts_backend_update_context *_ctx, uint32_t uid)
@@ -293,6 +405,10 @@ static bool fts_backend_xapian_update_set_build_key(struct fts_backend_update_co
 	ctx->tbi_isfield=false;
 	ctx->tbi_uid=0;
 	ctx->tbi_field=NULL;
+	if(ctx->html!=NULL) delete(ctx->html);
+	ctx->html=NULL;
+	if(ctx->quotes!=NULL) delete(ctx->quotes);
+	ctx->quotes=NULL;
 
 	if(backend->guid == NULL)
 	{
@@ -346,6 +462,11 @@ static bool fts_backend_xapian_update_set_build_key(struct fts_backend_update_co
 		}
 		if(field<1) field=HDR_BODY;
 	}
+	if(fts_xapian_field_skip[field])
+	{
+		if(fts_xapian_settings.verbose>1) i_info("FTS Xapian: Skipping field '%s'",hdrs_emails[field]);
+		return FALSE;
+	}
 
 	switch (key->type)
 	{
@@ -363,16 +484,13 @@ static bool fts_backend_xapian_update_set_build_key(struct fts_backend_update_co
 			return FALSE;
 	}
 
-	long n = backend->threads.size();
-	while(n>0)
-	{
-		n--;
-		if(backend->threads.at(n)->err) return FALSE;
-		if(!(backend->threads.at(n)->started))
-		{
-			backend->threads[n]->launch("Relaunch post error");
-		}
-	}
+	if(backend->err) return FALSE;
+
+	// Mailbox being bulk indexed by another process : its messages are left to the next update
+	if(backend->bulk_busy) return FALSE;
+	if(backend->bulk && (backend->bulk_done != NULL) && (backend->bulk_done->count(ctx->tbi_uid)>0)) return FALSE;
+
+	long n;
 
 	ctx->tbi_field = i_strdup_printf("%ld",field);
 
@@ -383,36 +501,38 @@ static bool fts_backend_xapian_update_set_build_key(struct fts_backend_update_co
 
 		if(fts_xapian_settings.verbose>0) i_info("%s",s.c_str());
 
-		if(backend->threads.size() < backend->max_threads )
-		{
-			XDocsWriter * x = new XDocsWriter(backend,backend->threads.size()+1);
-			x->launch(s.c_str());
-			backend->threads.push_back(x);
-		}
+		if(fts_backend_xapian_dict_deferred()) fts_backend_xapian_sqlite3_dict_commit(backend,fts_xapian_settings.verbose,XAPIAN_DICT_MAX);
+
+		// Small batches (like a delivery) are written inline at closure, the pool takes over beyond
+		if(backend->attached || backend->bulk || (backend->docs.size() >= XAPIAN_INLINE_DOCS)) fts_backend_xapian_pool_attach(backend,s.c_str());
+
+		// Writers behind : beyond the cache, the previous doc waits in the spool file rather than in memory
+		// (in stream mode, the docs hold terms and no raw parts : the producer is throttled instead)
+		bool spooled = false;
+		if((backend->lastuid>0) && (backend->docs.size() > XAPIAN_WRITING_CACHE) && (!fts_backend_xapian_tokenize_stream())) spooled = fts_backend_xapian_spool(backend);
 							  
 		fts_backend_xapian_get_lock(backend, fts_xapian_settings.verbose, s.c_str());
 		{
-			if(backend->lastuid>0)
+			if((backend->lastuid>0) && (backend->docs.size()>0))
 			{
 				if(fts_xapian_settings.verbose>0) i_info("FTS Xapian: Previous doc ready to index (#%ld)",backend->lastuid);
 				backend->docs.front()->status=1;	
 			}
 			backend->lastuid = ctx->tbi_uid;
-			backend->docs.insert(backend->docs.begin(),new XDoc(backend));
+			backend->docs.insert(backend->docs.begin(),new XDoc(backend->lastuid,backend->path));
+			if(!backend->bulk) (*(backend->uncommitted))[backend->lastuid]=false;
 		
 			if(fts_xapian_settings.verbose>0) i_info("FTS Xapian: Start indexing #%ld (%s) : Queue size = %ld",backend->lastuid, backend->boxname,backend->docs.size());
 		}
 		fts_backend_xapian_release_lock(backend, fts_xapian_settings.verbose, s.c_str());
+		if(backend->attached) fts_backend_xapian_pool_signal();
 
-		if(backend->docs.size() > (XAPIAN_WRITING_CACHE * 2) )
+		if((!spooled) && (backend->docs.size() > (XAPIAN_WRITING_CACHE * 2)))
 		{
 			n=0;
 			while (backend->docs.size() > XAPIAN_WRITING_CACHE)
 			{
-				for(auto & xwr : backend->threads)
-				{
-					if(xwr->err) return FALSE;
-				}
+				if(backend->err) return FALSE;
 				n++;
 				if(n>50)
 				{
@@ -424,19 +544,65 @@ static bool fts_backend_xapian_update_set_build_key(struct fts_backend_update_co
 		}
 	}
 
+	// HTML bodies are turned into text as they arrive
+	if((!ctx->tbi_isfield) && (type != NULL) && (strncmp(type,"text/html",9)==0)) ctx->html = new XHtml();
+
+	// Replies quote the previous messages of the thread, already indexed
+	if((!ctx->tbi_isfield) && (!ctx->isattachment) && ((type == NULL) || (strncmp(type,"text/plain",10)==0)) && fts_backend_xapian_quotes_skip()) ctx->quotes = new XQuotes();
+
+	// Attachments are looked up by content once complete
+	if(backend->docs.size()>0) backend->docs.front()->part_start(ctx->isattachment && (!ctx->tbi_isfield));
+
 	return TRUE;
 }
 
+static void fts_backend_xapian_update_load(struct xapian_fts_backend *backend, long h, const char * d, size_t size)
+{
+	if(backend->docs.size()<1) return;
+
+	// A short chunk may still end a word started in the previous one
+	if(fts_backend_xapian_tokenize_stream())
+	{
+		backend->docs.front()->stream_load(h,d,size);
+		return;
+	}
+
+	if(strlen(d)<(unsigned long)fts_xapian_settings.partial) return;
+
+	backend->docs.front()->raw_load(h,d,size,fts_xapian_settings.verbose,"fts_backend_xapian_index");
+}
+
 static void fts_backend_xapian_update_unset_build_key(struct fts_backend_update_context *_ctx)
 {
 	struct xapian_fts_backend_update_context *ctx = (struct xapian_fts_backend_update_context *)_ctx;
+	struct xapian_fts_backend *backend = (struct xapian_fts_backend *) ctx->ctx.backend;
 
 	if(fts_xapian_settings.verbose>1) i_info("FTS Xapian: fts_backend_xapian_update_unset_build_key");
 
+	// Last line of the part, held by the quotes filter
+	if(ctx->quotes!=NULL)
+	{
+		std::string s;
+		ctx->quotes->flush(s);
+		if((s.length()>0) && (ctx->tbi_field!=NULL)) fts_backend_xapian_update_load(backend,atol(ctx->tbi_field),s.c_str(),s.length());
+		fts_xapian_quotes_dropped += ctx->quotes->dropped;
+		delete(ctx->quotes);
+		ctx->quotes=NULL;
+	}
+
+	// The last word of the part must not be glued to the next part
+	if(fts_backend_xapian_tokenize_stream() && (backend->docs.size()>0)) backend->docs.front()->stream_end();
+	if(backend->docs.size()>0) backend->docs.front()->part_end();
+
 	if(ctx->tbi_field!=NULL)
 	{
 		i_free(ctx->tbi_field);
 	}
+	if(ctx->html!=NULL)
+	{
+		delete(ctx->html);
+		ctx->html=NULL;
+	}
 	ctx->tbi_uid=0;
 	ctx->tbi_field=NULL;
 }
@@ -458,11 +624,27 @@ static int fts_backend_xapian_update_build_more(struct fts_backend_update_contex
 	if(data == NULL) return 0;
 
 	const char * d = (const char *) data;
-	if(strlen(d)<(unsigned long)fts_xapian_settings.partial) return 0;
-
 	long h = atol(ctx->tbi_field);
 
-	if(backend->docs.size()>0) backend->docs.front()->raw_load(h,d,size,fts_xapian_settings.verbose,"fts_backend_xapian_index");
+	if(backend->docs.size()<1) return 0;
+
+	std::string text;
+	if(ctx->html!=NULL)
+	{
+		ctx->html->strip(d,size,text);
+		d = text.c_str();
+		size = text.length();
+	}
+
+	std::string unquoted;
+	if(ctx->quotes!=NULL)
+	{
+		ctx->quotes->filter(d,size,unquoted);
+		d = unquoted.c_str();
+		size = unquoted.length();
+	}
+
+	fts_backend_xapian_update_load(backend,h,d,size);
 			
 	return 0;
 }
@@ -473,6 +655,8 @@ static int fts_backend_xapian_optimize(struct fts_backend *_backend)
 
 	if(fts_xapian_settings.verbose>1) i_info("FTS Xapian: fts_backend_xapian_optimize '%s'",backend->path);
 
+	fts_backend_xapian_closers_wait(NULL);
+
 	struct stat sb;
 	if(!( (stat(backend->path, &sb)==0) && S_ISDIR(sb.st_mode)))
 	{
@@ -496,9 +680,11 @@ static int fts_backend_xapian_optimize(struct fts_backend *_backend)
 		s = dp->d_name;
 		if((dp->d_type == DT_REG) && s.starts_with("db_") && s.ends_with(suffixExp) )
 		{
+			// The files of the DB are beside the expunges one, in the index folder (not the current one)
+			s = std::string(backend->path) + "/" + dp->d_name;
 			uids.clear();
 			i_info("FTS Xapian: Optimize (1) : Checking expunges from %s",dp->d_name);
-			if(sqlite3_open_v2(dp->d_name,&expdb,SQLITE_OPEN_FULLMUTEX | SQLITE_OPEN_READWRITE,NULL) == SQLITE_OK)
+			if(sqlite3_open_v2(s.c_str(),&expdb,SQLITE_OPEN_FULLMUTEX | SQLITE_OPEN_READWRITE,NULL) == SQLITE_OK)
 			{
 				if(fts_xapian_settings.verbose>0) i_info("FTS Xapian: Optimize (2) : Executing %s",selectExpUIDs);
 				if(sqlite3_exec(expdb,selectExpUIDs,fts_backend_xapian_sqlite3_vector_int,&uids,&zErrMsg) != SQLITE_OK)	
@@ -568,6 +754,17 @@ static int fts_backend_xapian_optimize(struct fts_backend *_backend)
 						}
 						i_free(u);
 					}
+					if(fts_backend_xapian_dict_deferred())
+					{
+						if(!fts_backend_xapian_sqlite3_dict_rebuild(db,(s+suffixDict).c_str(),fts_xapian_settings.verbose)) ret=-1;
+					}
+					// The words of a bulk indexing in progress are in the dictionnary, but not in this DB yet
+					if(std::filesystem::exists(s+suffixBulk))
+					{
+						if(fts_xapian_settings.verbose>0) i_info("FTS Xapian: Optimize - Bulk indexing of %s in progress, dictionnary not swept",s.c_str());
+					}
+					else if(fts_backend_xapian_sqlite3_dict_sweep(db,(s+suffixDict).c_str(),fts_xapian_settings.verbose)<0) ret=-1;
+					fts_backend_xapian_bloom_rebuild(db,(s+suffixBloom).c_str(),fts_xapian_settings.verbose);
 					if(fts_xapian_settings.verbose>0) i_info("FTS Xapian: Optimize - Closing DB %s",s.c_str());
 					fts_backend_xapian_close_db(db,s.c_str(),"fts_optimize",fts_xapian_settings.verbose);
 				}
@@ -618,15 +815,83 @@ static int fts_backend_xapian_lookup(struct fts_backend *_backend, struct mailbo
 	i_array_init(&(result->maybe_uids),0);
 	i_array_init(&(result->scores),0);
 
+	// Docs queued or written but not committed yet by this process are not searched : their UIDs are
+	// left to Dovecot for verification, nothing waits for the writers. The words not flushed in the
+	// dictionnary yet are expanded from a copy of the pending ones
+	ARRAY_TYPE(seq_range) unsaved;
+	i_array_init(&unsaved,0);
+	XDict * pending = NULL;
+	fts_backend_xapian_get_lock(backend, fts_xapian_settings.verbose, "lookup");
+	for(auto & u : *(backend->uncommitted)) seq_range_array_add(&unsaved,(uint32_t)u.first);
+	if(backend->dict->size()>0)
+	{
+		pending = new XDict();
+		pending->copy(backend->dict);
+	}
+	fts_backend_xapian_release_lock(backend, fts_xapian_settings.verbose, "lookup");
+	if((array_count(&unsaved)>0) && (fts_xapian_settings.verbose>0)) i_info("FTS Xapian: %u docs of '%s' not committed yet, left to be verified",seq_range_count(&unsaved),backend->boxname);
+
+	// Trigrams filter : the box is skipped if it can not contain the keywords
+	{
+		XBloom bloom;
+		if(bloom.load(backend->bloom_db) && (!bloom.saturated()))
+		{
+			fts_backend_xapian_get_lock(backend, fts_xapian_settings.verbose, "lookup filter");
+			bloom.merge(backend->bloom);
+			fts_backend_xapian_release_lock(backend, fts_xapian_settings.verbose, "lookup filter");
+			if(!fts_backend_xapian_bloom_check(&bloom,args,(flags & FTS_LOOKUP_FLAG_AND_ARGS) != 0))
+			{
+				if(fts_xapian_settings.verbose>0) i_info("FTS Xapian: Skipping '%s' (%s) : no match in filter",backend->boxname,backend->guid);
+				i_array_init(&(result->definite_uids),0);
+				seq_range_array_merge(&result->maybe_uids, &unsaved);
+				array_free(&unsaved);
+				if(pending != NULL) delete(pending);
+				return 0;
+			}
+		}
+	}
+
 	if(!fts_backend_xapian_open_readonly(backend, &dbr))
 	{
 		i_array_init(&(result->definite_uids),0);
+		seq_range_array_merge(&result->maybe_uids, &unsaved);
+		array_free(&unsaved);
+		if(pending != NULL) delete(pending);
 		return 0;
 	}
 
+	bool and_args = ((flags & FTS_LOOKUP_FLAG_AND_ARGS) != 0);
+
+	// Results cache : keyed by the unexpanded query, for the current revision of the DB
+	std::string key;
+	if((fts_xapian_settings.querycache>0) && (array_count(&unsaved)==0))
+	{
+		XQuerySet kq(and_args ? Xapian::Query::OP_AND : Xapian::Query::OP_OR,fts_xapian_settings.partial);
+		fts_backend_xapian_build_qs(&kq,args);
+		try
+		{
+			std::string rev = dbr->get_uuid() + ":" + std::to_string(dbr->get_revision()) + ":" + fts_backend_xapian_expunges_generation(backend);
+			fts_xapian_querycache.validate(backend->guid,rev);
+			key = std::string(backend->guid) + (and_args ? "|AND|" : "|OR|") + kq.get_string();
+		}
+		catch(Xapian::Error e)
+		{
+			key.clear();
+		}
+		if((key.length()>0) && fts_xapian_querycache.get(key,result))
+		{
+			if(fts_xapian_settings.verbose>0) i_info("FTS Xapian: Query '%s' from cache (hits=%ld misses=%ld) in %ld ms",key.c_str(),fts_xapian_querycache.hits,fts_xapian_querycache.misses,fts_backend_xapian_current_time() - current_time);
+			dbr->close();
+			delete(dbr);
+			array_free(&unsaved);
+			if(pending != NULL) delete(pending);
+			return 0;
+		}
+	}
+
 	XQuerySet * qs;
 
-	if((flags & FTS_LOOKUP_FLAG_AND_ARGS) != 0)
+	if(and_args)
 	{
 		if(fts_xapian_settings.verbose>1) i_info("FTS Xapian: FLAG=AND");
 		qs = new XQuerySet(Xapian::Query::OP_AND,fts_xapian_settings.partial);
@@ -637,36 +902,99 @@ static int fts_backend_xapian_lookup(struct fts_backend *_backend, struct mailbo
 		qs = new XQuerySet(Xapian::Query::OP_OR,fts_xapian_settings.partial);
 	}
 
-	fts_backend_xapian_build_qs(qs,args,backend->dict_db);
+	long expansion = fts_xapian_settings.queryterms;
+	bool complete = fts_backend_xapian_build_qs(qs,args,backend->dict_db,(expansion>0) ? &expansion : NULL,dbr,pending);
 
-	XResultSet * r=fts_backend_xapian_query(dbr,qs);
+	// Top-level negations : NOT a AND NOT b = NOT (a OR b), NOT a OR NOT b = NOT (a AND b)
+	XQuerySet * neg = qs->split_negatives(and_args ? Xapian::Query::OP_OR : Xapian::Query::OP_AND);
 
-	long n=r->size;
-	if(fts_xapian_settings.verbose>0) { i_info("FTS Xapian: Query '%s' -> %ld results",qs->get_string().c_str(),n); }
+	// Planning : what can not match is dropped, the AND operands are ordered from the rarest
+	qs->plan(dbr);
+	if(neg!=NULL) neg->plan(dbr);
+	bool skip = and_args && qs->matches_nothing();
+	if(skip)
+	{
+		if(fts_xapian_settings.verbose>0) i_info("FTS Xapian: A required word has no match in '%s'",backend->boxname);
+		if(neg!=NULL) delete(neg);
+		neg=NULL;
+	}
+	else if((neg!=NULL) && and_args && (qs->count()>0))
+	{
+		// The positive args bound the search, Xapian removes the negated ones
+		XQuerySet * q2 = new XQuerySet(Xapian::Query::OP_AND_NOT,qs->limit);
+		q2->add(qs);
+		q2->add(neg);
+		qs=q2;
+		neg=NULL;
+	}
 
-	i_array_init(&(result->definite_uids),r->size);
+	// Highest indexed UID
+	uint32_t last=0;
+	try
+	{
+		last = Xapian::sortable_unserialise(dbr->get_value_upper_bound(1));
+	}
+	catch(Xapian::Error e)
+	{
+		i_error("FTS Xapian: %s",e.get_msg().c_str());
+	}
 
-	uint32_t uid;
-	for(long i=0;i<n;i++)
+	ARRAY_TYPE(seq_range) uids;
+	i_array_init(&uids,0);
+	ARRAY_TYPE(seq_range) unindexed;
+	i_array_init(&unindexed,0);
+	if((!skip) && ((neg==NULL) || (qs->count()>0) || qs->matches_all()))
 	{
-		try
-		{
-			uid=Xapian::sortable_unserialise(dbr->get_document(r->data[i]).get_value(1));
-			seq_range_array_add(&result->definite_uids, uid);
-		}
-		catch(Xapian::Error e)
+		if(!fts_backend_xapian_query_uids(dbr,qs,&uids,fts_xapian_settings.querydocs,fts_xapian_settings.querytimeout)) complete=false;
+		if(fts_xapian_settings.verbose>0) { i_info("FTS Xapian: Query '%s' -> %u results",qs->get_string().c_str(),seq_range_count(&uids)); }
+	}
+	if(neg!=NULL)
+	{
+		// Complement of the negated args over the indexed UIDs, computed on ranges.
+		// The UIDs without a doc (not indexable, write errors) are unknown : left to Dovecot
+		ARRAY_TYPE(seq_range) excluded;
+		i_array_init(&excluded,0);
+		if(!fts_backend_xapian_query_uids(dbr,neg,&excluded,fts_xapian_settings.querydocs,fts_xapian_settings.querytimeout)) complete=false;
+		if(last>0)
 		{
-			i_error("FTS Xapian: %s",e.get_msg().c_str());
+			ARRAY_TYPE(seq_range) complement;
+			i_array_init(&complement,0);
+			fts_backend_xapian_indexed_uids(dbr,last,&complement);
+			seq_range_array_add_range(&unindexed,1,last);
+			seq_range_array_remove_seq_range(&unindexed,&complement);
+			seq_range_array_remove_seq_range(&complement,&excluded);
+			seq_range_array_merge(&uids,&complement);
+			array_free(&complement);
 		}
+		if(fts_xapian_settings.verbose>0) { i_info("FTS Xapian: Query 'NOT (%s)' -> %u excluded of %u",neg->get_string().c_str(),seq_range_count(&excluded),last); }
+		array_free(&excluded);
+		delete(neg);
 	}
-	delete(r);
+	// Query budget exceeded : the UIDs the query did not reach are unknown, so all the indexed ones
+	// are left to Dovecot for verification (a UID in no list is taken as a non-match)
+	if((!complete) && (last>0)) seq_range_array_add_range(&uids,1,last);
+	unsigned int n = seq_range_count(&uids);
+	if(!complete) i_warning("FTS Xapian: Query '%s' exceeded its budget, returning %u messages to be verified",qs->get_string().c_str(),n);
+
+	i_array_init(&(result->definite_uids),0);
+	seq_range_array_merge(complete ? &result->definite_uids : &result->maybe_uids, &uids);
+	seq_range_array_remove_seq_range(&unindexed,&uids);
+	seq_range_array_merge(&result->maybe_uids, &unindexed);
+	seq_range_array_remove_seq_range(&result->definite_uids,&unsaved);
+	seq_range_array_merge(&result->maybe_uids, &unsaved);
+	array_free(&uids);
+	array_free(&unindexed);
+	array_free(&unsaved);
 	delete(qs);
 
 	dbr->close();
 	delete(dbr);
+	if(pending != NULL) delete(pending);
+
+	if(complete && (key.length()>0)) fts_xapian_querycache.put(key,backend->guid,result,fts_xapian_settings.querycache);
 
 	/* Performance calc */
-	if(fts_xapian_settings.verbose>0) i_info("FTS Xapian: %ld results in %ld ms",n,fts_backend_xapian_current_time() - current_time);
+	if(fts_xapian_settings.verbose>0) i_info("FTS Xapian: %u results in %ld ms",n,fts_backend_xapian_current_time() - current_time);
 
 	return 0;
 }
@@ -9,9 +9,28 @@
 #define XAPIAN_TERM_SIZELIMIT 245L // Hard limit of Xapian library
 #define XAPIAN_MAXTERMS_PERDOC 50000L // Nb of keywords max per email
 #define XAPIAN_WRITING_CACHE 5000L // Max nb of emails processed in cache 
+#define XAPIAN_INLINE_DOCS 8L // Max nb of emails indexed without the writing threads
 #define XAPIAN_DICT_MAX 60000L // Max nb of terms	in the dict
+#define XAPIAN_STREAM_CARRY 1024L // Max bytes of a word kept between two chunks
+#define XAPIAN_SPOOL_MAX 1073741824L // Size of the spool file beyond which the producer waits for the writers
+#define XAPIAN_LARGE_DOC 1048576L // Bytes from which an email is scheduled and tokenized as large
+#define XAPIAN_LARGE_LANE 4L // At most 1 writer out of 4 on large emails
+#define XAPIAN_LARGE_SPLIT 4L // Max nb of slices of a large email, tokenized by the idle writers
+#define XAPIAN_LARGE_CUT 4096L // Bytes searched for a space when a large part is cut in slices
+#define XAPIAN_BULK_FACTOR 10L // Commit batch multiplier in bulk mode
+#define XAPIAN_BLOOM_BITS 1048576L // Size of the trigrams filter of each mailbox
+#define XAPIAN_BLOOM_HASHES 3L
+#define XAPIAN_BLOOM_MAGIC "XBLOOM01"
+#define XAPIAN_BLOOM_FULL 0.75f // Fill ratio beyond which the filter rejects too few boxes to be worth reading
+#define XAPIAN_UID_RANGES 64L // Max nb of UID ranges pushed into a query
+#define XAPIAN_TERMSCACHE_MAX 1000000L // Max nb of terms kept in each terms cache
+#define XAPIAN_TERMSCACHE_MAGIC "XTERMS02-SHA256" // format and digest of the keys
+#define XAPIAN_JUNK_ENTROPY 4.2f // Bits per char above which a long keyword is random data
+#define XAPIAN_JUNK_MIX 0.2f // Share of digits and of letters above which a long keyword is an id
+#define XAPIAN_QUOTES_LINE 1024L // Max length of a line checked as a reply marker
 #define XAPIAN_MAX_ERRORS 1024L 
 #define XAPIAN_MAX_SEC_WAIT 15L
+#define XAPIAN_MAX_CLOSING 4L // Max nb of mailboxes committed in background
 
 #define HDRS_NB 11
 static const char * hdrs_emails[HDRS_NB] =  { "uid", "subject", "from", "to",	 "cc",  "bcc",	 "messageid", "listid", "body", "contenttype", ""	};
@@ -21,18 +40,28 @@ static const char * hdrs_query[HDRS_NB]  =  { "a", "b", "c", "d",   "d",   "e",
 
 static const char * createExpTable = "CREATE TABLE IF NOT EXISTS expunges(ID INTEGER PRIMARY KEY NOT NULL);";
 static const char * selectExpUIDs = "select ID from expunges;";
+static const char * countExpUIDs = "select count(*), max(ID) from expunges;";
 static const char * replaceExpUID = "replace into expunges values (%d);";
 static const char * deleteExpUID = "delete from expunges where ID=%d;";
 static const char * suffixExp = "_exp.db";
 
-static const char * createDictTable = "CREATE TABLE IF NOT EXISTS dict (keyword TEXT COLLATE NOCASE, header INTEGER, len INTEGER, UNIQUE(keyword,header));";
+static const char * createDictTable = "CREATE TABLE IF NOT EXISTS dict (keyword TEXT COLLATE NOCASE, header INTEGER, len INTEGER, PRIMARY KEY(keyword,header)) WITHOUT ROWID;";
 static const char * createDictIndexes = "CREATE INDEX IF NOT EXISTS dict_len ON dict (len); CREATE INDEX IF NOT EXISTS dict_h ON dict(header); CREATE INDEX IF NOT EXISTS dict_t ON dict(keyword);";
-static const char * createTmpTable = "ATTACH DATABASE ':memory:' AS work; CREATE TABLE work.dict (keyword TEXT COLLATE NOCASE, header INTEGER, len INTEGER, UNIQUE(keyword,header) ); CREATE INDEX IF NOT EXISTS work.dict_h ON dict(header)";
-static const char * replaceTmpWord ="INSERT OR IGNORE INTO work.dict VALUES('";
-static const char * flushTmpWords = "BEGIN TRANSACTION; INSERT OR IGNORE INTO main.dict SELECT keyword, header, len FROM work.dict; DELETE FROM work.dict; COMMIT;";
+static const char * walDict = "PRAGMA journal_mode=WAL; PRAGMA synchronous=NORMAL;";
+static const char * insertDictWord = "INSERT OR IGNORE INTO main.dict VALUES(?1,?2,?3);";
+static const char * selectDictWords = "SELECT keyword, header FROM dict;";
+static const char * deleteDictWord = "DELETE FROM dict WHERE keyword=?1 AND header=?2;";
+static const char * vacuumDict = "VACUUM;";
 static const char * searchDict1 = "SELECT keyword FROM dict WHERE keyword like '%";
-static const char * searchDict2 = " ORDER BY len LIMIT 100";
+static const char * searchDict2 = " ORDER BY len LIMIT ";
 static const char * suffixDict = "_dict.db";
+static const char * suffixBulk = "_bulk";
+static const char * suffixLock = "_lock";
+static const char * suffixBloom = "_bloom";
+static const char * suffixCompact = "_compact";
+static const char * suffixOld = "_old";
+static const char * suffixSpool = "_spool";
+static const char * fileAttachCache = "attachments.cache";
 
 #define CHAR_KEY "_"
 #define CHAR_SPACE " "
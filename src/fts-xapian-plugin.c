@@ -76,7 +76,25 @@ static void fts_xapian_mail_user_created(struct mail_user *user)
 	fuser->set.verbose		= 0;
 	fuser->set.lowmemory	= XAPIAN_MIN_RAM;
 	fuser->set.partial		= XAPIAN_DEFAULT_PARTIAL;
+	fuser->set.partial_mode	= XAPIAN_PARTIAL_SUBSTRING;
+	fuser->set.dictmode		= XAPIAN_DICT_INDEX;
+	fuser->set.tokenize		= XAPIAN_TOKENIZE_WRITER;
 	fuser->set.maxthreads	= 0;
+	fuser->set.bulk		= XAPIAN_DEFAULT_BULK;
+	fuser->set.querytimeout	= 0;
+	fuser->set.queryterms	= 0;
+	fuser->set.querydocs	= 0;
+	fuser->set.querycache	= XAPIAN_DEFAULT_QUERYCACHE;
+	fuser->set.termscache	= XAPIAN_DEFAULT_TERMSCACHE;
+	fuser->set.attachcache	= XAPIAN_DEFAULT_ATTACHCACHE;
+	fuser->set.attachcache_mode	= XAPIAN_ATTACHCACHE_MEMORY;
+	fuser->set.junkmode		= XAPIAN_JUNK_OFF;
+	fuser->set.junklength	= XAPIAN_DEFAULT_JUNKLENGTH;
+	fuser->set.quotes		= XAPIAN_QUOTES_KEEP;
+	fuser->set.fieldbytes	= "";
+	fuser->set.fieldterms	= "";
+	fuser->set.skipfields	= "";
+	fuser->set.attachbytes	= 0;
 
 	const char * env = mail_user_plugin_getenv(user, XAPIAN_LABEL);
 	if (env == NULL)
@@ -100,6 +118,51 @@ static void fts_xapian_mail_user_created(struct mail_user *user)
 				}
 				fuser->set.partial = len;
 			}
+			else if (strncmp(*tmp,"partial_mode=",13)==0)
+			{
+				if(strcmp(*tmp + 13,XAPIAN_PARTIAL_PREFIX)==0)
+				{
+					fuser->set.partial_mode = XAPIAN_PARTIAL_PREFIX;
+				}
+				else if(strcmp(*tmp + 13,XAPIAN_PARTIAL_SUBSTRING)==0)
+				{
+					fuser->set.partial_mode = XAPIAN_PARTIAL_SUBSTRING;
+				}
+				else
+				{
+					i_error("FTS Xapian: 'partial_mode' parameter is incorrect (%s). Try 'partial_mode=%s'",*tmp + 13,XAPIAN_PARTIAL_SUBSTRING);
+				}
+			}
+			else if (strncmp(*tmp,"dictmode=",9)==0)
+			{
+				if(strcmp(*tmp + 9,XAPIAN_DICT_COMMIT)==0)
+				{
+					fuser->set.dictmode = XAPIAN_DICT_COMMIT;
+				}
+				else if(strcmp(*tmp + 9,XAPIAN_DICT_INDEX)==0)
+				{
+					fuser->set.dictmode = XAPIAN_DICT_INDEX;
+				}
+				else
+				{
+					i_error("FTS Xapian: 'dictmode' parameter is incorrect (%s). Try 'dictmode=%s'",*tmp + 9,XAPIAN_DICT_INDEX);
+				}
+			}
+			else if (strncmp(*tmp,"tokenize=",9)==0)
+			{
+				if(strcmp(*tmp + 9,XAPIAN_TOKENIZE_STREAM)==0)
+				{
+					fuser->set.tokenize = XAPIAN_TOKENIZE_STREAM;
+				}
+				else if(strcmp(*tmp + 9,XAPIAN_TOKENIZE_WRITER)==0)
+				{
+					fuser->set.tokenize = XAPIAN_TOKENIZE_WRITER;
+				}
+				else
+				{
+					i_error("FTS Xapian: 'tokenize' parameter is incorrect (%s). Try 'tokenize=%s'",*tmp + 9,XAPIAN_TOKENIZE_WRITER);
+				}
+			}
 			else if (strncmp(*tmp,"verbose=",8)==0)
 			{
 				len=atol(*tmp + 8);
@@ -115,6 +178,117 @@ static void fts_xapian_mail_user_created(struct mail_user *user)
 				len=atol(*tmp + 11);
 				if(len>0) { fuser->set.maxthreads = len; }
 			}
+			else if (strncmp(*tmp,"bulk=",5)==0)
+			{
+				len=atol(*tmp + 5);
+				if(len>=0) { fuser->set.bulk = len; }
+			}
+			else if (strncmp(*tmp,"querytimeout=",13)==0)
+			{
+				len=atol(*tmp + 13);
+				if(len>0) { fuser->set.querytimeout = len; }
+			}
+			else if (strncmp(*tmp,"queryterms=",11)==0)
+			{
+				len=atol(*tmp + 11);
+				if(len>0) { fuser->set.queryterms = len; }
+			}
+			else if (strncmp(*tmp,"querydocs=",10)==0)
+			{
+				len=atol(*tmp + 10);
+				if(len>0) { fuser->set.querydocs = len; }
+			}
+			else if (strncmp(*tmp,"querycache=",11)==0)
+			{
+				len=atol(*tmp + 11);
+				if(len>=0) { fuser->set.querycache = len; }
+			}
+			else if (strncmp(*tmp,"termscache=",11)==0)
+			{
+				len=atol(*tmp + 11);
+				if(len>=0) { fuser->set.termscache = len; }
+			}
+			else if (strncmp(*tmp,"attachcache_mode=",17)==0)
+			{
+				if(strcmp(*tmp + 17,XAPIAN_ATTACHCACHE_DISK)==0)
+				{
+					fuser->set.attachcache_mode = XAPIAN_ATTACHCACHE_DISK;
+				}
+				else if(strcmp(*tmp + 17,XAPIAN_ATTACHCACHE_MEMORY)==0)
+				{
+					fuser->set.attachcache_mode = XAPIAN_ATTACHCACHE_MEMORY;
+				}
+				else
+				{
+					i_error("FTS Xapian: 'attachcache_mode' parameter is incorrect (%s). Try 'attachcache_mode=%s'",*tmp + 17,XAPIAN_ATTACHCACHE_MEMORY);
+				}
+			}
+			else if (strncmp(*tmp,"attachcache=",12)==0)
+			{
+				len=atol(*tmp + 12);
+				if(len>=0) { fuser->set.attachcache = len; }
+			}
+			else if (strncmp(*tmp,"junkmode=",9)==0)
+			{
+				if(strcmp(*tmp + 9,XAPIAN_JUNK_DROP)==0)
+				{
+					fuser->set.junkmode = XAPIAN_JUNK_DROP;
+				}
+				else if(strcmp(*tmp + 9,XAPIAN_JUNK_TRUNCATE)==0)
+				{
+					fuser->set.junkmode = XAPIAN_JUNK_TRUNCATE;
+				}
+				else if(strcmp(*tmp + 9,XAPIAN_JUNK_OFF)==0)
+				{
+					fuser->set.junkmode = XAPIAN_JUNK_OFF;
+				}
+				else
+				{
+					i_error("FTS Xapian: 'junkmode' parameter is incorrect (%s). Try 'junkmode=%s'",*tmp + 9,XAPIAN_JUNK_DROP);
+				}
+			}
+			else if (strncmp(*tmp,"junklength=",11)==0)
+			{
+				len=atol(*tmp + 11);
+				if(len<XAPIAN_DEFAULT_PARTIAL)
+				{
+					i_error("FTS Xapian: 'junklength' parameter is incorrect (%ld). Try 'junklength=%ld'",len,XAPIAN_DEFAULT_JUNKLENGTH);
+					len=XAPIAN_DEFAULT_JUNKLENGTH;
+				}
+				fuser->set.junklength = len;
+			}
+			else if (strncmp(*tmp,"quotes=",7)==0)
+			{
+				if(strcmp(*tmp + 7,XAPIAN_QUOTES_SKIP)==0)
+				{
+					fuser->set.quotes = XAPIAN_QUOTES_SKIP;
+				}
+				else if(strcmp(*tmp + 7,XAPIAN_QUOTES_KEEP)==0)
+				{
+					fuser->set.quotes = XAPIAN_QUOTES_KEEP;
+				}
+				else
+				{
+					i_error("FTS Xapian: 'quotes' parameter is incorrect (%s). Try 'quotes=%s'",*tmp + 7,XAPIAN_QUOTES_KEEP);
+				}
+			}
+			else if (strncmp(*tmp,"fieldbytes=",11)==0)
+			{
+				fuser->set.fieldbytes = p_strdup(user->pool, *tmp + 11);
+			}
+			else if (strncmp(*tmp,"fieldterms=",11)==0)
+			{
+				fuser->set.fieldterms = p_strdup(user->pool, *tmp + 11);
+			}
+			else if (strncmp(*tmp,"skipfields=",11)==0)
+			{
+				fuser->set.skipfields = p_strdup(user->pool, *tmp + 11);
+			}
+			else if (strncmp(*tmp,"attachbytes=",12)==0)
+			{
+				len=atol(*tmp + 12);
+				if(len>=0) { fuser->set.attachbytes = len; }
+			}
 			else if (strncmp(*tmp,"attachments=",12)==0)
 			{
 				// Legacy
@@ -167,6 +341,7 @@ void fts_xapian_plugin_deinit(void)
 {
 	fts_backend_unregister(fts_backend_xapian.name);
 	mail_storage_hooks_remove(&fts_xapian_mail_storage_hooks);
+	fts_backend_xapian_pool_stop();
 }
 
 const char *fts_xapian_plugin_dependencies[] = { "fts", NULL };
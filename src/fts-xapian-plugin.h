@@ -36,6 +36,24 @@
 #define XAPIAN_FILE_PREFIX "xapian-indexes" // Locations of indexes
 #define XAPIAN_MIN_RAM 300L // MB
 #define XAPIAN_DEFAULT_PARTIAL 3L
+#define XAPIAN_DEFAULT_BULK 10000L // Nb of messages from which a first indexing is done in bulk
+#define XAPIAN_DEFAULT_QUERYCACHE 64L // Nb of search results kept in cache
+#define XAPIAN_DEFAULT_TERMSCACHE 128L // Nb of messages whose terms are kept for copies
+#define XAPIAN_DEFAULT_ATTACHCACHE 256L // Nb of attachments whose terms are kept
+#define XAPIAN_DEFAULT_JUNKLENGTH 32L // Length from which a keyword may be junk (encoded data, digest, id)
+#define XAPIAN_PARTIAL_SUBSTRING "substring"
+#define XAPIAN_PARTIAL_PREFIX "prefix"
+#define XAPIAN_DICT_INDEX "index"
+#define XAPIAN_DICT_COMMIT "commit"
+#define XAPIAN_TOKENIZE_WRITER "writer"
+#define XAPIAN_TOKENIZE_STREAM "stream"
+#define XAPIAN_ATTACHCACHE_MEMORY "memory"
+#define XAPIAN_ATTACHCACHE_DISK "disk"
+#define XAPIAN_JUNK_OFF "off"
+#define XAPIAN_JUNK_DROP "drop"
+#define XAPIAN_JUNK_TRUNCATE "truncate"
+#define XAPIAN_QUOTES_KEEP "keep"
+#define XAPIAN_QUOTES_SKIP "skip"
 
 struct fts_xapian_settings
 {
@@ -45,7 +63,25 @@ struct fts_xapian_settings
 	unsigned int verbose;
 	unsigned int lowmemory;
 	unsigned int partial;
+	const char *partial_mode;
+	const char *dictmode;
+	const char *tokenize;
 	unsigned int maxthreads;
+	unsigned int bulk;
+	unsigned int querytimeout;
+	unsigned int queryterms;
+	unsigned int querydocs;
+	unsigned int querycache;
+	unsigned int termscache;
+	unsigned int attachcache;
+	const char *attachcache_mode;
+	const char *junkmode;
+	unsigned int junklength;
+	const char *quotes;
+	const char *fieldbytes;
+	const char *fieldterms;
+	const char *skipfields;
+	unsigned int attachbytes;
 };
 
 struct fts_xapian_user {
@@ -78,5 +114,6 @@ extern const struct setting_parser_info fts_xapian_setting_parser_info;
 
 void fts_xapian_plugin_init(struct module *module);
 void fts_xapian_plugin_deinit(void);
+void fts_backend_xapian_pool_stop(void);
 
 #endif
@@ -15,7 +15,25 @@ static const struct setting_define fts_xapian_setting_defines[] =
 	DEF(UINT, verbose),
 	DEF(UINT, lowmemory),
 	DEF(UINT, partial),
+	DEF(ENUM, partial_mode),
+	DEF(ENUM, dictmode),
+	DEF(ENUM, tokenize),
 	DEF(UINT, maxthreads),
+	DEF(UINT, bulk),
+	DEF(UINT, querytimeout),
+	DEF(UINT, queryterms),
+	DEF(UINT, querydocs),
+	DEF(UINT, querycache),
+	DEF(UINT, termscache),
+	DEF(UINT, attachcache),
+	DEF(ENUM, attachcache_mode),
+	DEF(ENUM, junkmode),
+	DEF(UINT, junklength),
+	DEF(ENUM, quotes),
+	DEF(STR, fieldbytes),
+	DEF(STR, fieldterms),
+	DEF(STR, skipfields),
+	DEF(UINT, attachbytes),
 	SETTING_DEFINE_LIST_END
 };
 
@@ -24,15 +42,47 @@ static const struct fts_xapian_settings fts_xapian_default_settings =
 	.verbose = 0,
 	.lowmemory = XAPIAN_MIN_RAM,
 	.partial = XAPIAN_DEFAULT_PARTIAL,
+	.partial_mode = XAPIAN_PARTIAL_SUBSTRING":"XAPIAN_PARTIAL_PREFIX,
+	.dictmode = XAPIAN_DICT_INDEX":"XAPIAN_DICT_COMMIT,
+	.tokenize = XAPIAN_TOKENIZE_WRITER":"XAPIAN_TOKENIZE_STREAM,
 	.maxthreads = 0,
+	.bulk = XAPIAN_DEFAULT_BULK,
+	.querytimeout = 0,
+	.queryterms = 0,
+	.querydocs = 0,
+	.querycache = XAPIAN_DEFAULT_QUERYCACHE,
+	.termscache = XAPIAN_DEFAULT_TERMSCACHE,
+	.attachcache = XAPIAN_DEFAULT_ATTACHCACHE,
+	.attachcache_mode = XAPIAN_ATTACHCACHE_MEMORY":"XAPIAN_ATTACHCACHE_DISK,
+	.junkmode = XAPIAN_JUNK_OFF":"XAPIAN_JUNK_DROP":"XAPIAN_JUNK_TRUNCATE,
+	.junklength = XAPIAN_DEFAULT_JUNKLENGTH,
+	.quotes = XAPIAN_QUOTES_KEEP":"XAPIAN_QUOTES_SKIP,
+	.fieldbytes = "",
+	.fieldterms = "",
+	.skipfields = "",
+	.attachbytes = 0,
 };
 
+/* Below the partial length, plain words (hex letters only, numbers) would be taken for junk */
+static bool fts_xapian_settings_check(void *_set, pool_t pool ATTR_UNUSED, const char **error_r)
+{
+	struct fts_xapian_settings *set = _set;
+
+	if(set->junklength < set->partial)
+	{
+		*error_r = t_strdup_printf(XAPIAN_LABEL"_junklength (%u) can not be lower than "XAPIAN_LABEL"_partial (%u)",set->junklength,set->partial);
+		return FALSE;
+	}
+	return TRUE;
+}
+
 const struct setting_parser_info fts_xapian_setting_parser_info = 
 {
 	.name = XAPIAN_LABEL,
 
 	.defines = fts_xapian_setting_defines,
 	.defaults = &fts_xapian_default_settings,
+	.check_func = fts_xapian_settings_check,
 
 	.struct_size = sizeof(struct fts_xapian_settings),
 	.pool_offset1 = 1 + offsetof(struct fts_xapian_settings, pool),